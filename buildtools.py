@@ -58,8 +58,8 @@ CFLAGS_STRICT = ["-Wall", "-Wextra", "-Werror"]
 LDFLAGS = ["-flto"]
 ASFLAGS = ["-f", "elf32"]
 
-QEMUFLAGS = ["-m", "256M", "-serial", "mon:stdio", "-enable-kvm"]
-QEMUFLAGS_NOKVM = ["-m", "256M", "-serial", "mon:stdio"]
+QEMUFLAGS = ["-m", "256M", "-smp", "4", "-serial", "mon:stdio", "-enable-kvm"]
+QEMUFLAGS_NOKVM = ["-m", "256M", "-smp", "4", "-serial", "mon:stdio"]
 
 
 def QEMU(disk):
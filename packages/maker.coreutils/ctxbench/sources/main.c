@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <skift/thread.h>
+
+// Two threads of the same process hand a token back and forth, each pass
+// blocks one thread on a futex and wakes the other one. Both threads are
+// pinned to the same processor, so we measure switches and not the IPIs
+// waking up another processor.
+//
+// Build the kernel with SHEDULER_LAZY_CR3 set to 0 to compare with the
+// sheduler reloading CR3 on every switch.
+
+#define ROUNDS 1000
+
+static volatile int token = 0;
+static u64 elapsed = 0;
+
+static inline u64 rdtsc(void)
+{
+    u64 r;
+    asm volatile("rdtsc"
+                 : "=A"(r));
+    return r;
+}
+
+// There is no libgcc to divide 64-bit numbers, divl does it in two steps.
+static u64 divide(u64 n, uint d, uint *remainder)
+{
+    uint high = (uint)(n >> 32) / d;
+    uint rest = (uint)(n >> 32) % d;
+    uint low;
+
+    asm("divl %4"
+        : "=a"(low), "=d"(rest)
+        : "a"((uint)n), "d"(rest), "rm"(d));
+
+    if (remainder != NULL)
+    {
+        *remainder = rest;
+    }
+
+    return ((u64)high << 32) | low;
+}
+
+void pinger()
+{
+    u64 start = rdtsc();
+
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        token = 1;
+        sk_thread_futex_wake((int *)&token, 1);
+
+        while (token == 1)
+        {
+            sk_thread_futex_wait((int *)&token, 1);
+        }
+    }
+
+    elapsed = rdtsc() - start;
+
+    sk_thread_exit(NULL);
+}
+
+void ponger()
+{
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        while (token != 1)
+        {
+            sk_thread_futex_wait((int *)&token, 0);
+        }
+
+        token = 0;
+        sk_thread_futex_wake((int *)&token, 1);
+    }
+
+    sk_thread_exit(NULL);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    int pong = sk_thread_create((int)&ponger, NULL, THREAD_PINNED);
+    int ping = sk_thread_create((int)&pinger, NULL, THREAD_PINNED);
+
+    sk_thread_wait(ping);
+    sk_thread_wait(pong);
+
+    uint low;
+    uint high = (uint)divide(elapsed, 1000000000, &low);
+    uint per_switch = (uint)divide(elapsed, ROUNDS * 2, NULL);
+
+    if (high > 0)
+    {
+        printf("%d round trips in %d%09d cycles, %d cycles per switch.\n", ROUNDS, high, low, per_switch);
+    }
+    else
+    {
+        printf("%d round trips in %d cycles, %d cycles per switch.\n", ROUNDS, low, per_switch);
+    }
+
+    return 0;
+}
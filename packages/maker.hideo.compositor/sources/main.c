@@ -146,6 +146,9 @@ int main(int argc, char const *argv[])
             .y = height / 2,
         }};
 
+    // Input events must be handled ahead of the other applications.
+    sk_thread_setpolicy(sk_thread_self(), THREAD_POLICY_RR, THREAD_PRIORITY_NORMAL);
+
     // Enter the message loop
     sk_messaging_subscribe(KEYBOARD_CHANNEL);
     sk_messaging_subscribe(MOUSE_CHANNEL);
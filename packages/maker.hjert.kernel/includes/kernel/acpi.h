@@ -0,0 +1,69 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+typedef PACKED(struct)
+{
+    char signature[8]; // "RSD PTR "
+    u8 checksum;
+    char oemid[6];
+    u8 revision;
+    u32 rsdt;
+} acpi_rsdp_t;
+
+typedef PACKED(struct)
+{
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oemid[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} acpi_sdt_t;
+
+typedef PACKED(struct)
+{
+    acpi_sdt_t header;
+    u32 tables[];
+} acpi_rsdt_t;
+
+/* --- MADT ----------------------------------------------------------------- */
+
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_LAPIC_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED 1
+
+typedef PACKED(struct)
+{
+    acpi_sdt_t header;
+    u32 lapic; // Physical address of the local APICs.
+    u32 flags;
+} acpi_madt_t;
+
+typedef PACKED(struct)
+{
+    u8 type;
+    u8 length;
+} acpi_madt_entry_t;
+
+typedef PACKED(struct)
+{
+    acpi_madt_entry_t header;
+    u8 processor_id;
+    u8 apic_id;
+    u32 flags;
+} acpi_madt_lapic_t;
+
+void acpi_setup();
+
+// Return a pointer to the ACPI table with the given signature, or NULL.
+acpi_sdt_t *acpi_table(const char *signature);
@@ -27,4 +27,6 @@ typedef struct
 } time_t;
 
 void clock_time(time_t *time);
-uint clock_read(time_selector_t selector);
\ No newline at end of file
+uint clock_read(time_selector_t selector);
+
+void clock_advance(time_t *time); // Move the time one second forward.
\ No newline at end of file
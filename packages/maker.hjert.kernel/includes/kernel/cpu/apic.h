@@ -0,0 +1,27 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Inter-processor interrupts
+#define LAPIC_IPI_INIT 0x00004500
+#define LAPIC_IPI_STARTUP 0x00004600
+#define LAPIC_IPI_FIXED 0x00004000 // Or'ed with the vector.
+
+void lapic_setup(uint paddr);
+void lapic_enable(); // Enable the local APIC of the current processor.
+bool lapic_present();
+
+int lapic_id(); // Return the id of the local APIC of the current processor.
+void lapic_eoi();
+
+void lapic_send_ipi(int apic_id, u32 command);
+
+void lapic_timer_calibrate();
+void lapic_timer_oneshot(u8 vector, uint usec); // Fire the vector once in usec on the current processor.
+void lapic_timer_stop();
@@ -0,0 +1,20 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+#include "kernel/tasking.h"
+
+#define FPU_STATE_SIZE 512 // Size of the FXSAVE area.
+
+void fpu_setup();
+void fpu_enable(); // Enable the FPU and SSE on the current processor.
+
+// Called by the sheduler when switching to a thread, the FPU state is only
+// restored when the thread actually use it.
+void fpu_switch(cpu_t *cpu, thread_t *thread);
+
+void fpu_release(thread_t *thread); // Forget the FPU state of a dying thread.
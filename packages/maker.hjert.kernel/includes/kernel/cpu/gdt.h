@@ -73,6 +73,7 @@ typedef struct
 } gdt_t;
 
 void gdt_setup();
+void gdt_load(); // Load the gdt on the current processor.
 void gdt_entry(int index, u32 base, u32 limit, u8 access, u8 flags, string hint);
 void gdt_tss_entry(int index, u16 ss0, u32 esp0);
 
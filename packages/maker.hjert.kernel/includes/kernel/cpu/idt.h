@@ -43,4 +43,5 @@ typedef PACKED(struct)
 
 void pic_setup();
 void idt_setup();
+void idt_load(); // Load the idt on the current processor.
 void idt_entry(u8 index, u32 offset, u16 selector, u16 type);
\ No newline at end of file
@@ -7,6 +7,12 @@
 #include <skift/generic.h>
 #include "kernel/processor.h"
 
+#define IRQ_COUNT 20
+#define IRQ_LAPIC_TIMER 16 // Timer of the local APIC, used by the application processors.
+#define IRQ_SCHEDULE 17    // Software interrupt raised by a thread giving up the cpu.
+#define IRQ_RESCHEDULE 18  // Sent by another processor which made a thread ready here.
+#define IRQ_TLB_SHOOTDOWN 19 // Sent by another processor which changed a mapping.
+
 typedef reg32_t (*irq_handler_t)(reg32_t, processor_context_t *);
 
 void irq_setup();
@@ -0,0 +1,10 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+void sysenter_setup();
+void sysenter_enable(); // Point the SYSENTER MSRs of the current processor at the kernel.
@@ -0,0 +1,23 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+#include "kernel/shared/datapage.h"
+#include "kernel/paging.h"
+
+void datapage_setup();
+
+kernel_datapage_t *datapage_kernel(); // NULL until datapage_setup() is done.
+
+// Called by the timer with its lock held each time the clock moves forward.
+void datapage_update(uint ticks, u64 uptime);
+
+process_datapage_t *datapage_create(page_directorie_t *pdir, int process);
+void datapage_destroy(process_datapage_t *page);
+
+void datapage_add_thread(process_datapage_t *page, int thread, uint stack);
+void datapage_remove_thread(process_datapage_t *page, int thread);
@@ -0,0 +1,43 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+/*
+ * A handle is the index of a slot in the table and the generation of that
+ * slot, so a stale handle to a freed and reused slot is detected.
+ */
+
+#define HANDLE_INDEX_BITS 12
+#define HANDLE_INDEX_MASK ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK 0x7ffff
+
+#define HANDLE_INDEX(handle) ((handle) & HANDLE_INDEX_MASK)
+#define HANDLE_GENERATION(handle) (((handle) >> HANDLE_INDEX_BITS) & HANDLE_GENERATION_MASK)
+#define HANDLE(generation, index) (((generation) << HANDLE_INDEX_BITS) | (index))
+
+typedef struct
+{
+    void *object;
+    uint generation;
+    int next_free;
+} handle_entry_t;
+
+typedef struct
+{
+    handle_entry_t *entries;
+    int capacity;
+    int count;
+
+    int free_head; // Index of the first free entry, -1 if none.
+} handle_table_t;
+
+handle_table_t *handle_table();
+void handle_table_delete(handle_table_t *table);
+
+int handle_alloc(handle_table_t *table, void *object); // Return 0 if the table is full.
+void handle_free(handle_table_t *table, int handle);
+void *handle_get(handle_table_t *table, int handle);
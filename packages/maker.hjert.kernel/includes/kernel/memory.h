@@ -6,6 +6,7 @@
 
 #include <skift/generic.h>
 
+#include "kernel/multiboot.h"
 #include "kernel/paging.h"
 
 /* --- Physical Memory ------------------------------------------------------ */
@@ -20,7 +21,20 @@ void virtual_free(page_directorie_t *pdir, uint vaddr, uint count);
 
 /* --- Logical Memory ------------------------------------------------------- */
 
-void memory_setup(uint used, uint total);
+void memory_setup(uint used, multiboot_info_t *minfo);
+void memory_enable(); // Enable the paging features used by the kernel on the current processor.
+
+uint memory_used();  // Bytes of physical memory in use.
+uint memory_total(); // Bytes of usable physical memory.
+
+void memory_tlb_poll(); // Flush the TLB if another processor sent us a shootdown.
+
+// Clear a free frame ahead of time for the allocations that want zero-filled
+// memory, return false once the pool is full. Called by the idle threads.
+bool memory_clear_frame();
+
+uint memory_zeroed_hits();   // Pages allocated from the pool of cleared frames.
+uint memory_zeroed_misses(); // Pages that had to be cleared on allocation.
 
 page_directorie_t *memory_kpdir();
 
@@ -29,12 +43,25 @@ void memory_free(page_directorie_t *pdir, uint addr, uint count, int user);
 uint memory_alloc_at(page_directorie_t *pdir, uint count, uint paddr, int user);
 uint memory_alloc_identity(page_directorie_t * pdir, uint count, int user);
 
+// Back the memory with 4Mio pages when the processor and the address space
+// allow it, falling back to the functions above otherwise.
+uint memory_alloc_large(page_directorie_t *pdir, uint count, int user);
+uint memory_alloc_at_large(page_directorie_t *pdir, uint count, uint paddr, int user);
+
 page_directorie_t *memory_alloc_pdir();
 void memory_free_pdir(page_directorie_t *pdir);
 
+// Share the user memory of the loaded page directory with `child`, copy-on-write.
+// Return -1 if we ran out of memory, `child` must then be freed.
+int memory_clone_pdir(page_directorie_t *child, page_directorie_t *parent);
+
 int memory_map(page_directorie_t *pdir, uint addr, uint count, int user);
 int memory_unmap(page_directorie_t *pdir, uint addr, uint count);
 
+// Map frames owned by someone else read-only in the userspace, they are left
+// alone when the page directory is freed.
+int memory_map_readonly(page_directorie_t *pdir, uint addr, uint paddr, uint count);
+
 int memory_identity_map(page_directorie_t *pdir, uint addr, uint count);
 int memory_identity_unmap(page_directorie_t *pdir, uint addr, uint count);
 
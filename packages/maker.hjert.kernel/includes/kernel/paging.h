@@ -10,6 +10,7 @@
 #define PAGE_DIRECTORIE_ENTRY_COUNT 1024
 
 #define PAGE_SIZE 0x1000
+#define LARGE_PAGE_SIZE 0x400000 // Mapped by a single page directory entry when CR4.PSE is set.
 #define PAGE_ALIGN(x) ((x) + PAGE_SIZE - ((x) % PAGE_SIZE))
 #define IS_PAGE_ALIGN(x) (x % PAGE_SIZE == 0)
 
@@ -25,7 +26,10 @@ typedef PACKED(union) // page table entry
         bool Accessed : 1;
         bool Dirty : 1;
         bool Pat : 1;
-        u32 Ignored : 4;
+        bool Global : 1; // Kept in the TLB across CR3 reloads when CR4.PGE is set.
+        bool Shared : 1;      // The frame is not owned by this page directory.
+        bool CopyOnWrite : 1; // The frame is shared read-only, copied on the first write.
+        u32 Ignored : 1;
         u32 PageFrameNumber : 20;
     };
 
@@ -51,7 +55,8 @@ typedef PACKED(union) // page directorie entry
         bool Accessed : 1;
         bool Ignored1 : 1;
         bool LargePage : 1;
-        u32 Ignored2 : 4;
+        bool Global : 1; // Only used by large pages.
+        u32 Ignored2 : 3;
         u32 PageFrameNumber : 20;
     };
     u32 as_uint;
@@ -66,4 +71,10 @@ page_directorie_t;
 
 extern void paging_enable(void);
 extern void paging_load_directorie(page_directorie_t *directorie);
-extern void paging_invalidate_tlb();
\ No newline at end of file
+extern void paging_invalidate_tlb();
+
+// Drop the TLB entry of a single page, global or not.
+static inline void paging_invalidate_page(uint vaddr)
+{
+    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+}
\ No newline at end of file
@@ -55,10 +55,36 @@ static inline reg32_t CR4()
     return r;
 }
 
+static inline void set_cr0(reg32_t value)
+{
+    asm volatile("mov %0, %%cr0" ::"r"(value));
+}
+
+static inline void set_cr4(reg32_t value)
+{
+    asm volatile("mov %0, %%cr4" ::"r"(value));
+}
+
 static inline void cli(void) { asm volatile("cli"); }
 static inline void sti(void) { asm volatile("sti"); }
 static inline void hlt(void) { asm volatile("hlt"); }
 
+static inline bool interrupts_enabled(void)
+{
+    u32 flags;
+    asm volatile("pushf\n"
+                 "pop %0"
+                 : "=r"(flags));
+    return flags & 0x200;
+}
+
+static inline u64 rdtsc(void)
+{
+    u64 r;
+    asm volatile("rdtsc": "=A"(r));
+    return r;
+}
+
 static inline u8 inb(u16 port)
 {
     u8 data;
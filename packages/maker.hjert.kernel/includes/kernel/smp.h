@@ -0,0 +1,17 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+#include "kernel/tasking.h"
+
+#define MAX_CPU 16
+
+void smp_setup(); // Start the application processors listed in the ACPI MADT.
+
+int smp_cpu_count();
+cpu_t *cpu_get(int id);
+cpu_t *cpu_self(); // Return the processor executing the caller.
@@ -0,0 +1,70 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+/*
+ * Spinlocks are recursive for the processor holding them. Holding a spinlock
+ * keeps the current thread from being switched out, the *_irqsave variants
+ * also disable interrupts and must be used for any lock taken from an
+ * interrupt handler.
+ *
+ * A given lock is always taken with the same variant.
+ */
+
+// Set to 1 to keep track of how long each lock is held.
+#define SPINLOCK_DEBUG 0
+
+// Holding a lock longer than this is reported by spinlock_dump_all().
+#define SPINLOCK_DEBUG_THRESHOLD 1000000 // cpu cycles
+
+typedef struct
+{
+    volatile int locked;
+    int owner;       // Id of the processor holding the lock, -1 if free.
+    uint depth;      // How many times the owner acquired the lock.
+    bool interrupts; // Interrupt flag to restore when the lock is released.
+    const char *name;
+
+#if SPINLOCK_DEBUG
+    bool registered;
+    u64 acquired;  // Timestamp of the outermost acquire.
+    u64 longest;   // Longest hold time in cpu cycles.
+    uint overruns; // Number of holds longer than the threshold.
+    uint contentions;
+#endif
+} spinlock_t;
+
+#define SPINLOCK(__name)      \
+    {                         \
+        .locked = 0,          \
+        .owner = -1,          \
+        .depth = 0,           \
+        .interrupts = false,  \
+        .name = __name,       \
+    }
+
+void spinlock_init(spinlock_t *lock, const char *name);
+
+void spinlock_acquire(spinlock_t *lock);
+void spinlock_release(spinlock_t *lock);
+bool spinlock_try_acquire(spinlock_t *lock); // Return false if the lock is held, even by this processor.
+
+void spinlock_acquire_irqsave(spinlock_t *lock);
+void spinlock_release_irqrestore(spinlock_t *lock);
+
+bool spinlock_held(spinlock_t *lock); // Return true if the current processor holds the lock.
+
+void spinlock_disable_all(); // Turn all locks into no-ops, used by the kernel panic.
+
+void spinlock_dump_all();
+
+/* --- Preemption ----------------------------------------------------------- */
+
+void preempt_disable(); // Keep the current thread on the processor until preempt_enable().
+void preempt_enable();
+bool preempt_enabled();
+void preempt_check(); // Switch to a thread woken up while preemption was disabled.
@@ -6,5 +6,9 @@
 
 #include <skift/generic.h>
 #include "kernel/processor.h"
+#include "kernel/shared/syscalls.h"
 
-void syscall_dispatcher(processor_context_t *context);
\ No newline at end of file
+void syscall_dispatcher(processor_context_t *context); // Called for `int 0x80`.
+
+// Called by sysenter_entry, with the registers used by the caller.
+int syscall_fast_dispatcher(syscall_t syscall, int p1, int p2, int p3, int p4, int p5);
\ No newline at end of file
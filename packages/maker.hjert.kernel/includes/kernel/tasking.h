@@ -8,17 +8,33 @@
 #include <skift/list.h>
 
 #include "kernel/paging.h"
+#include "kernel/processor.h"
 #include "kernel/protocol.h"
+#include "kernel/shared/datapage.h"
+#include "kernel/shared/memory.h"
+#include "kernel/shared/ring.h"
+#include "kernel/timer.h"
 
 #define CHANNAME_SIZE 128
 #define PROCNAME_SIZE 128
 #define STACK_SIZE 0x4000
 
+// Real-time threads can't use more than SHEDULER_RT_RUNTIME microseconds of
+// cpu time every SHEDULER_RT_PERIOD, the rest is left to normal threads.
+#define SHEDULER_RT_PERIOD 1000000
+#define SHEDULER_RT_RUNTIME 950000
+
+// Set to 0 to reload CR3 twice on every switch like the sheduler used to,
+// so ctxbench can compare both.
+#define SHEDULER_LAZY_CR3 1
+
 #define TASK_USER 1
 
 typedef int THREAD;  // Thread handle
 typedef int PROCESS; // Process handler
 
+typedef struct cpu cpu_t;
+
 typedef u32 esp_t;
 typedef void (*thread_entry_t)();
 
@@ -37,11 +53,17 @@ typedef enum thread_state
     THREAD_WAIT_THREAD,
     THREAD_WAIT_PROCESS,
     THREAD_WAIT_MESSAGE,
+    THREAD_WAIT_FUTEX,
 
     THREAD_CANCELING,
     THREAD_CANCELED,
 } thread_state_t;
 
+typedef struct
+{
+    list_t *threads; // Threads blocked on this queue.
+} wait_queue_t;
+
 typedef struct
 {
     int id;                   // Unique handle to the process
@@ -52,7 +74,13 @@ typedef struct
     list_t *inbox;
     list_t *shared; // Shared memory region;
 
+    wait_queue_t *waiters;       // Threads waiting for this process to exit.
+    wait_queue_t *inbox_waiters; // Threads waiting for a message.
+
     page_directorie_t *pdir; // Page directorie
+    process_datapage_t *datapage; // Mapped read-only in the process, NULL for the kernel.
+    ring_t *ring;                 // Submission ring, NULL until the process asks for it.
+    bool ring_busy;               // A thread of the process is running the ring.
     process_state_t state;   // State of the process (RUNNING, CANCELED)
 
     int exit_code;
@@ -71,7 +99,7 @@ typedef struct
 
 typedef struct
 {
-    uint wakeuptick;
+    timer_t timer;
 } sleep_info_t;
 
 typedef struct
@@ -84,19 +112,78 @@ typedef struct
     void *stack;
 
     thread_state_t state;
+    int priority;
+    int policy; // One of THREAD_POLICY_*.
+    cpu_t *cpu; // The processor this thread run or is queued on.
+    bool pinned; // Never stolen by another processor, see THREAD_PINNED.
 
     wait_info_t waitinfo;
     sleep_info_t sleepinfo;
     wait_message_t messageinfo;
 
+    wait_queue_t *waiters; // Threads waiting for this thread to exit.
+    wait_queue_t *blocker; // The wait queue this thread is blocked on.
+
+    void *fpu_state; // Allocated on the first use of the FPU.
+
     void *exit_value;
 } thread_t;
 
+struct cpu
+{
+    int id;      // Index of the processor, the boot processor is 0.
+    int apic_id; // Id of its local APIC.
+    bool online;
+
+    thread_t *current;  // The thread running on this processor.
+    thread_t *idle;     // Run when nothing else is ready, never in a run queue.
+    thread_t *previous; // Thread being switched out, until we left its stack.
+    thread_t *dead;     // Canceled thread to reap once we left its stack.
+    thread_t *fpu_owner; // The thread whose state is in the FPU registers.
+    uint preempt;        // Non zero while the current thread must not be switched out.
+    volatile bool tlb_shootdown; // A mapping changed, the TLB must be flushed.
+
+    list_t *ready[THREAD_PRIORITY_COUNT];
+    uint ready_bitmap;
+    list_t *rt_ready[THREAD_PRIORITY_COUNT]; // Real-time threads.
+    uint rt_bitmap;
+    uint ready_count;
+
+    bool resched;   // A thread more important than the current one is ready.
+    bool timeslice; // The local APIC timer is armed to end the current timeslice.
+
+    // Time used by real-time threads during the current period, they are not
+    // sheduled anymore once it goes over SHEDULER_RT_RUNTIME.
+    u64 rt_period;
+    u64 rt_since; // When the current real-time thread was switched in.
+    uint rt_runtime;
+    bool rt_throttled;
+};
+
 void tasking_setup();
 
+void tasking_cpu_setup(cpu_t *cpu); // Create the run queues and the idle thread of a processor.
+void tasking_cpu_enter(cpu_t *cpu); // Start sheduling threads on the current processor.
+void sheduler_switched();            // Called by the interrupt handler once it left the stack of the old thread.
+
+/* --- Wait queues ---------------------------------------------------------- */
+
+// Wait queues are protected by the tasking lock, which must be held while
+// calling the functions below (except for creating and deleting them).
+
+wait_queue_t *wait_queue();
+void wait_queue_delete(wait_queue_t *queue);
+
+// Block the current thread on the queue, the caller must then thread_hold().
+void wait_queue_block(wait_queue_t *queue, thread_state_t state);
+
+thread_t *wait_queue_wakeup(wait_queue_t *queue);              // Wake up the first waiter of the queue.
+void wait_queue_wakeup_all(wait_queue_t *queue, int outcode); // Wake up all waiters with an outcode.
+
 /* --- Thread managment ----------------------------------------------------- */
 
 THREAD thread_self(); // Return a handle to the current thread.
+thread_t *thread_running(); // Return the current thread, NULL before tasking is set up.
 
 // Create a new thread of a selected process.
 THREAD thread_create(PROCESS p, thread_entry_t entry, void *arg, int flags);
@@ -104,14 +191,37 @@ THREAD thread_create(PROCESS p, thread_entry_t entry, void *arg, int flags);
 int thread_cancel(THREAD t);    // Cancel the selected thread.
 void thread_exit(void *retval); // Exit the current thread and return a value.
 
-void thread_sleep(int time);  // Send the current thread to bed.
-void thread_wakeup(THREAD t); // Wake up the slected thread
+void thread_sleep(int time);    // Send the current thread to bed for some milliseconds.
+void thread_usleep(uint usec);  // Send the current thread to bed for some microseconds.
+void thread_wakeup(THREAD t);   // Wake up the slected thread
 
 void *thread_wait(THREAD t);    // Wait for the selected thread to exit and return the exit value
 int thread_waitproc(PROCESS p); // Wait for the slected process to exit and return the exit code.
 
 void thread_yield(); // Yield to the next thread.
 
+// Switch to the next thread right away, must not be called from an interrupt
+// handler or with a spinlock held.
+void schedule();
+
+// Save the context of the interrupted thread and return the stack of the next
+// one, called from interrupt handlers.
+esp_t shedule(esp_t esp, processor_context_t *context);
+
+// Switch to a woken up thread right away if it is more important than the
+// running one (enabled by default).
+void sheduler_set_wakeup_preempt(bool enabled);
+
+int thread_setpriority(THREAD t, int priority); // Change the sheduling priority of the selected thread.
+int thread_getpriority(THREAD t);               // Return the sheduling priority of the selected thread.
+
+int thread_setpolicy(THREAD t, int policy, int priority); // Move the selected thread to another sheduling policy.
+int thread_getpolicy(THREAD t);                           // Return the sheduling policy of the selected thread.
+
+// Block the current thread while *addr is equal to expected, return 1 if it was not.
+int thread_futex_wait(int *addr, int expected);
+int thread_futex_wake(int *addr, int count); // Wake up to count threads waiting on addr.
+
 void thread_dump_all();
 void thread_dump(THREAD t);
 
@@ -128,12 +238,23 @@ void process_exit(int code);    // Exit the current process and send and exit co
 int process_map(PROCESS p, uint addr, uint count);   // Map memory to the process memory space.
 int process_unmap(PROCESS p, uint addr, uint count); // Unmap memory from the current thread.
 
-uint process_alloc(uint count);           // Alloc some some memory page to the process memory space.
-void process_free(uint addr, uint count); // Free perviously allocated memory.
+uint process_alloc(uint count, int flags); // Alloc some some memory page to the process memory space, see PROCESS_ALLOC_*.
+void process_free(uint addr, uint count);  // Free perviously allocated memory.
+
+ring_t *process_ring_setup(); // Map the submission ring of the running process.
+
+// Give the ring of the running process to the caller, NULL if the process has
+// no ring or another of its threads is already running it.
+ring_t *process_ring_acquire();
+void process_ring_release();
 
 // Load a ELF executable, create a adress space and run it.
 PROCESS process_exec(const char *filename, const char **argv);
 
+// Create a copy of the running process, sharing its memory copy-on-write, with
+// a single thread starting at `entry`.
+PROCESS process_clone(thread_entry_t entry);
+
 /* --- Shared Memory -------------------------------------------------------- */
 
 typedef struct 
@@ -155,6 +276,8 @@ void  shared_memory_realease(void* mem);
 typedef struct
 {
     char name[CHANNAME_SIZE];
+    uint hash;
+
     list_t *subscribers;
 } channel_t;
 
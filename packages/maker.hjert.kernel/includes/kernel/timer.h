@@ -0,0 +1,46 @@
+#pragma once
+
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/generic.h>
+
+#define TIMER_FREQUENCY 1000 // Frequency of the ticks counter.
+#define TIMER_TICK_US (1000000 / TIMER_FREQUENCY)
+
+#define TIMER_QUANTUM 10000    // Default timeslice in microseconds.
+#define TIMER_MIN_DELAY 20     // Shortest delay the PIT get programmed with.
+#define TIMER_MAX_DELAY 54000  // Longest delay the PIT can be programmed with.
+
+typedef void (*timer_callback_t)(void *data);
+
+typedef struct
+{
+    u64 deadline; // Uptime in microseconds when the timer expire.
+    timer_callback_t callback;
+    void *data;
+
+    int index; // Position in the timer heap, -1 when the timer is not armed.
+} timer_t;
+
+void timer_setup();
+
+u64 timer_uptime(); // Return the number of microseconds since boot.
+void timer_tick();  // Update the clock and fire expired timers (called by the sheduler).
+
+// Program the next timer interrupt for the next deadline, or earlier if the
+// running thread have to be preempted at the end of its timeslice.
+void timer_reschedule(bool preempt);
+void timer_request_preempt(); // Make sure the running thread get preempted.
+
+void timer_set_quantum(uint usec);  // Set the timeslice given to threads.
+void timer_set_dynamic(bool dynamic); // Skip ticks when nothing is to be done.
+
+void timer_init(timer_t *timer, timer_callback_t callback, void *data);
+void timer_schedule(timer_t *timer, u64 deadline); // Arm the timer, or move its deadline.
+void timer_cancel(timer_t *timer);
+bool timer_armed(timer_t *timer);
+
+// Spin for some microseconds, usable before the interrupts are enabled.
+void timer_busy_wait(uint usec);
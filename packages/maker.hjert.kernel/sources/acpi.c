@@ -0,0 +1,155 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* acpi.c: Lookup of the ACPI tables left by the firmware.                    */
+
+#include <string.h>
+#include <skift/logger.h>
+
+#include "kernel/memory.h"
+
+#include "kernel/acpi.h"
+
+acpi_rsdt_t *rsdt = NULL;
+
+/* --- Private functions ---------------------------------------------------- */
+
+bool acpi_checksum(void *table, uint size)
+{
+    u8 sum = 0;
+
+    for (uint i = 0; i < size; i++)
+    {
+        sum += ((u8 *)table)[i];
+    }
+
+    return sum == 0;
+}
+
+acpi_rsdp_t *acpi_rsdp_lookup(uint start, uint size)
+{
+    // The RSDP is always aligned on a 16 bytes boundary.
+    for (uint addr = start; addr < start + size; addr += 16)
+    {
+        acpi_rsdp_t *rsdp = (acpi_rsdp_t *)addr;
+
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 &&
+            acpi_checksum(rsdp, sizeof(acpi_rsdp_t)))
+        {
+            return rsdp;
+        }
+    }
+
+    return NULL;
+}
+
+// Number of pages mapped for a table, at least two so the header of the
+// table is always readable.
+uint acpi_pages(uint offset, uint length)
+{
+    uint count = PAGE_ALIGN(offset + length) / PAGE_SIZE;
+
+    return count > 2 ? count : 2;
+}
+
+// Map a table in the kernel address space, they may be anywhere in the
+// physical memory and only the first megabytes are identity mapped.
+acpi_sdt_t *acpi_map(uint paddr)
+{
+    uint offset = paddr % PAGE_SIZE;
+
+    // Map the header first to know the length of the table.
+    uint vaddr = virtual_alloc(memory_kpdir(), paddr - offset, 2, 0);
+
+    if (vaddr == 0)
+    {
+        return NULL;
+    }
+
+    acpi_sdt_t *table = (acpi_sdt_t *)(vaddr + offset);
+    uint count = acpi_pages(offset, table->length);
+
+    if (count > 2)
+    {
+        virtual_free(memory_kpdir(), vaddr, 2);
+        vaddr = virtual_alloc(memory_kpdir(), paddr - offset, count, 0);
+        table = (acpi_sdt_t *)(vaddr + offset);
+    }
+
+    return vaddr ? table : NULL;
+}
+
+void acpi_unmap(acpi_sdt_t *table)
+{
+    uint offset = (uint)table % PAGE_SIZE;
+
+    virtual_free(memory_kpdir(), (uint)table - offset, acpi_pages(offset, table->length));
+}
+
+/* --- Public functions ----------------------------------------------------- */
+
+void acpi_setup()
+{
+    // The BIOS data area holds the segment of the EBDA. The pointer is
+    // volatile so the compiler doesn't see a dereference of a constant address
+    // in the first page and warn about it.
+    u16 *volatile ebda_segment = (u16 *)0x40E;
+
+    // Look in the first KiB of the EBDA then in the BIOS read-only memory.
+    uint ebda = *ebda_segment << 4;
+
+    acpi_rsdp_t *rsdp = acpi_rsdp_lookup(ebda, 1024);
+
+    if (rsdp == NULL)
+    {
+        rsdp = acpi_rsdp_lookup(0xE0000, 0x20000);
+    }
+
+    if (rsdp == NULL)
+    {
+        sk_log(LOG_WARNING, "No ACPI tables found!");
+        return;
+    }
+
+    rsdt = (acpi_rsdt_t *)acpi_map(rsdp->rsdt);
+
+    if (rsdt == NULL || !acpi_checksum(rsdt, rsdt->header.length))
+    {
+        sk_log(LOG_WARNING, "Invalid ACPI RSDT @%x!", rsdp->rsdt);
+        rsdt = NULL;
+        return;
+    }
+
+    sk_log(LOG_INFO, "ACPI tables found (RSDT @%x).", rsdp->rsdt);
+}
+
+acpi_sdt_t *acpi_table(const char *signature)
+{
+    if (rsdt == NULL)
+    {
+        return NULL;
+    }
+
+    uint count = (rsdt->header.length - sizeof(acpi_sdt_t)) / sizeof(u32);
+
+    for (uint i = 0; i < count; i++)
+    {
+        acpi_sdt_t *table = acpi_map(rsdt->tables[i]);
+
+        if (table == NULL)
+        {
+            continue;
+        }
+
+        if (memcmp(table->signature, signature, 4) == 0 &&
+            acpi_checksum(table, table->length))
+        {
+            return table;
+        }
+
+        acpi_unmap(table);
+    }
+
+    return NULL;
+}
@@ -46,4 +46,43 @@ uint clock_read(time_selector_t selector)
     CMOS_WAIT;
 
     return from_bcd(get_realtime_reg(selector));
-}
\ No newline at end of file
+}
+
+static const uint days_per_month[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+void clock_advance(time_t *time)
+{
+    if (++time->second < 60)
+        return;
+
+    time->second = 0;
+
+    if (++time->minute < 60)
+        return;
+
+    time->minute = 0;
+
+    if (++time->hour < 24)
+        return;
+
+    time->hour = 0;
+
+    // The CMOS only gives the last two digits of the year.
+    uint days = days_per_month[(time->month - 1) % 12];
+
+    if (time->month == 2 && time->year % 4 == 0)
+    {
+        days++;
+    }
+
+    if (++time->day <= days)
+        return;
+
+    time->day = 1;
+
+    if (++time->month <= 12)
+        return;
+
+    time->month = 1;
+    time->year = (time->year + 1) % 100;
+}
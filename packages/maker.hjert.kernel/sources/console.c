@@ -13,14 +13,17 @@
 
 #include <skift/logger.h>
 #include <skift/drawing.h>
-#include <skift/atomic.h>
 
 #include "kernel/graphic.h"
+#include "kernel/spinlock.h"
 #include "kernel/console.h"
 
 console_t *cons = NULL;
 bitmap_t *console_framebuffer;
 
+// The kernel logs from interrupt handlers, so the console lock disable them.
+spinlock_t console_lock = SPINLOCK("console");
+
 int colors[] =
     {
         [CCOLOR_DEFAULT_BACKGROUND] = 0x1D1F21,
@@ -303,7 +306,7 @@ void console_process(char c)
 
 void console_print(const char *s)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&console_lock);
 
     if (cons != NULL)
     {
@@ -313,17 +316,17 @@ void console_print(const char *s)
         }
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&console_lock);
 }
 
 void console_putchar(char c)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&console_lock);
 
     if (cons != NULL)
     {
         console_process(c);
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&console_lock);
 }
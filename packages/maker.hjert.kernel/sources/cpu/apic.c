@@ -0,0 +1,123 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* apic.c: Local APIC driver, used to start and tick the other processors.   */
+
+#include <skift/logger.h>
+
+#include "kernel/cpu/idt.h"
+#include "kernel/memory.h"
+#include "kernel/timer.h"
+
+#include "kernel/cpu/apic.h"
+
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_ICR_PENDING 0x1000
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_DIVIDE_BY_16 0x3
+
+#define LAPIC_CALIBRATION_US 10000
+
+// define in interupts.s
+extern u32 lapic_spurious;
+
+volatile u32 *lapic = NULL;
+uint lapic_ticks_per_ms = 0;
+
+/* --- Private functions ---------------------------------------------------- */
+
+u32 lapic_read(uint reg)
+{
+    return lapic[reg / 4];
+}
+
+void lapic_write(uint reg, u32 value)
+{
+    lapic[reg / 4] = value;
+}
+
+/* --- Public functions ----------------------------------------------------- */
+
+void lapic_setup(uint paddr)
+{
+    // Registers are mapped in the kernel space, so they are reachable whatever
+    // the current page directory is, and must not be cleared by memory_alloc_at().
+    lapic = (volatile u32 *)virtual_alloc(memory_kpdir(), paddr, 1, 0);
+
+    idt_entry(LAPIC_SPURIOUS_VECTOR, (u32)&lapic_spurious, 0x08, INTGATE);
+
+    sk_log(LOG_DEBUG, "Local APIC @%x mapped @%x.", paddr, lapic);
+}
+
+void lapic_enable()
+{
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+bool lapic_present()
+{
+    return lapic != NULL;
+}
+
+int lapic_id()
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(int apic_id, u32 command)
+{
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+        ;
+}
+
+void lapic_timer_calibrate()
+{
+    // Count down from the maximum while the PIT measure a known delay.
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_BY_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+
+    timer_busy_wait(LAPIC_CALIBRATION_US);
+
+    uint elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    lapic_ticks_per_ms = elapsed / (LAPIC_CALIBRATION_US / 1000);
+
+    sk_log(LOG_DEBUG, "Local APIC timer running at %d ticks/ms.", lapic_ticks_per_ms);
+}
+
+void lapic_timer_oneshot(u8 vector, uint usec)
+{
+    uint counts = lapic_ticks_per_ms * usec / 1000;
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_BY_16);
+    lapic_write(LAPIC_LVT_TIMER, vector);
+    lapic_write(LAPIC_TIMER_INITIAL, counts > 0 ? counts : 1);
+}
+
+void lapic_timer_stop()
+{
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
@@ -0,0 +1,184 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* fpu.c: Lazy switching of the FPU and SSE state.                           */
+
+/*
+ * Each processor remember which thread owns the content of its FPU and SSE
+ * registers. When switching to another thread CR0.TS is set, so the first
+ * FPU or SSE instruction raises a #NM. Only then the state of the owner is
+ * saved and the state of the current thread restored. Threads that never use
+ * floating point never pay for it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <skift/logger.h>
+
+#include "kernel/cpu/cpuid.h"
+#include "kernel/cpu/isr.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
+#include "kernel/system.h"
+
+#include "kernel/cpu/fpu.h"
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+#define FPU_NO_COPROCESSOR 7
+
+// Keep fpu_release() from freeing the state of a thread while a processor is
+// saving it.
+spinlock_t fpu_lock = SPINLOCK("fpu");
+
+bool fpu_fxsr = false;
+u8 ALIGNED(fpu_initial_state[FPU_STATE_SIZE], 16);
+
+/* --- Private functions ---------------------------------------------------- */
+
+static inline void clts(void) { asm volatile("clts"); }
+static inline void stts(void) { set_cr0(CR0() | CR0_TS); }
+
+void *fpu_area(thread_t *thread)
+{
+    return (void *)(((uint)thread->fpu_state + 15) & ~15);
+}
+
+void fpu_save(void *area)
+{
+    if (fpu_fxsr)
+    {
+        asm volatile("fxsave (%0)" ::"r"(area) : "memory");
+    }
+    else
+    {
+        asm volatile("fnsave (%0)" ::"r"(area) : "memory");
+    }
+}
+
+void fpu_restore(void *area)
+{
+    if (fpu_fxsr)
+    {
+        asm volatile("fxrstor (%0)" ::"r"(area) : "memory");
+    }
+    else
+    {
+        asm volatile("frstor (%0)" ::"r"(area) : "memory");
+    }
+}
+
+void fpu_trap(processor_context_t *context)
+{
+    UNUSED(context);
+
+    spinlock_acquire_irqsave(&fpu_lock);
+
+    cpu_t *cpu = cpu_self();
+    thread_t *thread = cpu->current;
+
+    clts();
+
+    if (cpu->fpu_owner != thread)
+    {
+        if (cpu->fpu_owner != NULL)
+        {
+            fpu_save(fpu_area(cpu->fpu_owner));
+        }
+
+        if (thread->fpu_state == NULL)
+        {
+            // First use, start from a clean state.
+            thread->fpu_state = malloc(FPU_STATE_SIZE + 15);
+            memcpy(fpu_area(thread), fpu_initial_state, FPU_STATE_SIZE);
+        }
+
+        fpu_restore(fpu_area(thread));
+        cpu->fpu_owner = thread;
+    }
+
+    spinlock_release_irqrestore(&fpu_lock);
+}
+
+/* --- Public functions ----------------------------------------------------- */
+
+void fpu_enable()
+{
+    set_cr0((CR0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+    if (fpu_fxsr)
+    {
+        set_cr4(CR4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    }
+
+    asm volatile("fninit");
+}
+
+void fpu_setup()
+{
+    u32 features = cpuid_get_feature_EDX();
+
+    if (!(features & CPUID_FEAT_EDX_FPU))
+    {
+        PANIC("No FPU found!");
+    }
+
+    fpu_fxsr = (features & CPUID_FEAT_EDX_FXSR) != 0;
+
+    fpu_enable();
+
+    // The state given to threads on their first use of the FPU.
+    fpu_save(fpu_initial_state);
+
+    if (!fpu_fxsr)
+    {
+        // fnsave reset the FPU, put it back.
+        asm volatile("fninit");
+    }
+
+    isr_register(FPU_NO_COPROCESSOR, fpu_trap);
+
+    stts();
+
+    sk_log(LOG_DEBUG, "FPU enabled (SSE=%d).", fpu_fxsr && (features & CPUID_FEAT_EDX_SSE));
+}
+
+void fpu_switch(cpu_t *cpu, thread_t *thread)
+{
+    // The registers already hold the state of the thread.
+    if (cpu->fpu_owner == thread)
+    {
+        clts();
+    }
+    else
+    {
+        stts();
+    }
+}
+
+void fpu_release(thread_t *thread)
+{
+    spinlock_acquire_irqsave(&fpu_lock);
+
+    for (int i = 0; i < smp_cpu_count(); i++)
+    {
+        cpu_t *cpu = cpu_get(i);
+
+        if (cpu->fpu_owner == thread)
+        {
+            cpu->fpu_owner = NULL;
+        }
+    }
+
+    free(thread->fpu_state);
+    thread->fpu_state = NULL;
+
+    spinlock_release_irqrestore(&fpu_lock);
+}
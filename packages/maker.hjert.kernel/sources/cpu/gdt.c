@@ -37,6 +37,11 @@ void gdt_setup()
     gdt_flush((u32)&gdt.descriptor);
 }
 
+void gdt_load()
+{
+    gdt_flush((u32)&gdt.descriptor);
+}
+
 void set_kernel_stack(u32 stack)
 {
     gdt.tss.esp0 = stack;
@@ -28,6 +28,11 @@ void idt_setup()
     load_idt((u32)&idt.descriptor);
 }
 
+void idt_load()
+{
+    load_idt((u32)&idt.descriptor);
+}
+
 void idt_entry(u8 index, u32 offset, u16 selector, u16 type)
 {
     // printf("IDT[%d]: OFFSET=0x%x SELECTOR=0x%x TYPE=%b\n", index, offset, selector, type);
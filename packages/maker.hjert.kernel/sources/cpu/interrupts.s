@@ -5,6 +5,7 @@
 ;; --- interrupt request ---------------------------------------------------- ;;
 
 extern irq_handler
+extern sheduler_switched
 
 %macro IRQ_NAME 1
 dd irq%1
@@ -42,6 +43,9 @@ irq_common:
 
     mov esp, eax
 
+    ; We left the stack of the thread switched out, if any.
+    call sheduler_switched
+
     pop gs
     pop fs
     pop es
@@ -69,6 +73,10 @@ IRQ 12
 IRQ 13
 IRQ 14
 IRQ 15
+IRQ 16 ; Local APIC timer
+IRQ 17 ; schedule()
+IRQ 18 ; Reschedule IPI
+IRQ 19 ; TLB shootdown IPI
 
 global irq_vector
 irq_vector:
@@ -88,6 +96,15 @@ irq_vector:
     IRQ_NAME 13
     IRQ_NAME 14
     IRQ_NAME 15
+    IRQ_NAME 16
+    IRQ_NAME 17
+    IRQ_NAME 18
+    IRQ_NAME 19
+
+; Spurious interrupts of the local APIC must not be acknowledged.
+global lapic_spurious
+lapic_spurious:
+    iret
 
 ;; --- Interrupts Service Routine ------------------------------------------- ;;
 
@@ -114,6 +131,15 @@ __isr%1:
     jmp isr_common
 %endmacro
 
+; Syscalls go through a trap gate and keep interrupts enabled, spinlocks take
+; care of disabling them when needed.
+%macro ISR_SYSCALL 1
+__isr%1:
+    push 0
+    push %1
+    jmp isr_common
+%endmacro
+
 isr_common:
     cld
 
@@ -177,7 +203,7 @@ ISR_NOERR 29
 ISR_NOERR 30
 ISR_NOERR 31
 
-ISR_NOERR 128
+ISR_SYSCALL 128
 
 
 global isr_vector
@@ -215,4 +241,29 @@ isr_vector:
     ISR_NAME 30
     ISR_NAME 31
     
-    ISR_NAME 128
\ No newline at end of file
+    ISR_NAME 128
+
+;; --- Fast system calls ---------------------------------------------------- ;;
+
+extern syscall_fast_dispatcher
+
+; Reached through SYSENTER, see __syscall(). Threads run in ring 0, so there
+; is no privilege change: the caller puts its stack pointer in ebp with the
+; return address on top, and we come back with a plain ret.
+global sysenter_entry
+sysenter_entry:
+    mov esp, ebp
+    sti
+
+    push edi
+    push esi
+    push edx
+    push ecx
+    push ebx
+    push eax
+
+    call syscall_fast_dispatcher
+
+    add esp, 24
+
+    ret
@@ -2,19 +2,20 @@
 /* This code is licensed under the MIT License.                               */
 /* See: LICENSE.md                                                            */
 
-#include <skift/atomic.h>
 #include <skift/logger.h>
 
+#include "kernel/cpu/apic.h"
 #include "kernel/cpu/irq.h"
 #include "kernel/cpu/idt.h"
+#include "kernel/smp.h"
+#include "kernel/tasking.h"
 
 extern u32 irq_vector[];
-extern bool console_bypass_lock;
-irq_handler_t irq_handlers[16];
+irq_handler_t irq_handlers[IRQ_COUNT];
 
 void irq_setup()
 {
-    for (u32 i = 0; i < 16; i++)
+    for (u32 i = 0; i < IRQ_COUNT; i++)
     {
         idt_entry(32 + i, irq_vector[i], 0x08, INTGATE);
     }
@@ -22,7 +23,7 @@ void irq_setup()
 
 irq_handler_t irq_register(int index, irq_handler_t handler)
 {
-    if (index < 16)
+    if (index < IRQ_COUNT)
     {
         irq_handlers[index] = handler;
         return handler;
@@ -33,8 +34,8 @@ irq_handler_t irq_register(int index, irq_handler_t handler)
 
 reg32_t irq_handler(reg32_t esp, processor_context_t context)
 {
-    sk_atomic_disable();
-
+    // Interrupts are disabled here, handlers take the locks of the data they
+    // touch themselves.
     if (irq_handlers[context.int_no] != NULL)
     {
         esp = irq_handlers[context.int_no](esp, &context);
@@ -44,14 +45,25 @@ reg32_t irq_handler(reg32_t esp, processor_context_t context)
         sk_log(LOG_WARNING,  "Unhandeled IRQ %d!", context.int_no);
     }
 
-    if (context.int_no >= 8)
+    if (context.int_no == IRQ_LAPIC_TIMER || context.int_no == IRQ_RESCHEDULE || context.int_no == IRQ_TLB_SHOOTDOWN)
     {
-        outb(0xA0, 0x20);
+        lapic_eoi();
     }
+    else if (context.int_no < 16)
+    {
+        if (context.int_no >= 8)
+        {
+            outb(0xA0, 0x20);
+        }
 
-    outb(0x20, 0x20);
+        outb(0x20, 0x20);
+    }
 
-    sk_atomic_enable();
+    // The handler woke up a thread more important than the one it interrupted.
+    if (cpu_self()->resched)
+    {
+        esp = shedule(esp, &context);
+    }
 
     return esp;
 }
\ No newline at end of file
@@ -88,5 +88,5 @@ void isr_handler(processor_context_t context)
 		}
 	}
 
-	outb(0x20, 0x20);
+	// Exceptions and syscalls don't come from the PIC, nothing to acknowledge.
 }
@@ -0,0 +1,59 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* sysenter.c: Fast system call entry.                                        */
+
+/*
+ * SYSENTER skips the IDT lookup and the full register save of `int 0x80`.
+ * SYSEXIT always returns to ring 3, but our threads still run in ring 0, so
+ * sysenter_entry returns to the caller with a plain ret instead.
+ *
+ * The runtime checks for SEP itself and keep using `int 0x80` without it.
+ */
+
+#include <skift/logger.h>
+#include <skift/utils.h>
+
+#include "kernel/cpu/cpuid.h"
+#include "kernel/smp.h"
+
+#include "kernel/cpu/sysenter.h"
+
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+// Only used until sysenter_entry switches back to the stack of the caller.
+#define SYSENTER_STACK_SIZE 256
+
+extern void sysenter_entry();
+
+bool sysenter_supported = false;
+u8 ALIGNED(sysenter_stacks[MAX_CPU][SYSENTER_STACK_SIZE], 16);
+
+static inline void wrmsr(u32 msr, u32 value)
+{
+    asm volatile("wrmsr" ::"c"(msr), "a"(value), "d"(0));
+}
+
+void sysenter_enable()
+{
+    if (!sysenter_supported)
+        return;
+
+    int id = cpu_self()->id;
+
+    wrmsr(MSR_SYSENTER_CS, 0x08);
+    wrmsr(MSR_SYSENTER_ESP, (u32)&sysenter_stacks[id][SYSENTER_STACK_SIZE]);
+    wrmsr(MSR_SYSENTER_EIP, (u32)&sysenter_entry);
+}
+
+void sysenter_setup()
+{
+    sysenter_supported = (cpuid_get_feature_EDX() & CPUID_FEAT_EDX_SEP) != 0;
+
+    sysenter_enable();
+
+    sk_log(LOG_DEBUG, "SYSENTER %s.", sysenter_supported ? "enabled" : "not supported");
+}
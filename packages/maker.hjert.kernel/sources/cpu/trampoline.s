@@ -0,0 +1,90 @@
+;; Copyright © 2018-2019 MAKER.                                               ;;
+;; This code is licensed under the MIT License.                               ;;
+;; See: LICENSE.md                                                            ;;
+
+;; trampoline.s: entry point of the application processors.                  ;;
+
+;; The code is copied at TRAMPOLINE_BASE and the processors start executing it
+;; in real mode, so every address is computed relative to this base.
+
+TRAMPOLINE_BASE equ 0x8000
+
+%define TRAMPOLINE(label) (TRAMPOLINE_BASE + (label - smp_trampoline_start))
+
+section .text
+
+global smp_trampoline_start
+global smp_trampoline_data
+global smp_trampoline_end
+
+bits 16
+smp_trampoline_start:
+    cli
+    cld
+
+    xor ax, ax
+    mov ds, ax
+
+    lgdt [TRAMPOLINE(trampoline_gdt_descriptor)]
+
+    ; INIT leaves the caches disabled (CR0.CD and NW set), the processor would
+    ; run uncached and could miss the writes of the others. Enable them while
+    ; entering protected mode.
+    mov eax, cr0
+    and eax, ~((1 << 30) | (1 << 29))
+    or eax, 1
+    mov cr0, eax
+
+    jmp dword 0x08:TRAMPOLINE(trampoline_protected)
+
+bits 32
+trampoline_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Enable the same paging features as the boot processor, the kernel page
+    ; directory may use large pages.
+    mov eax, [TRAMPOLINE(smp_trampoline_data) + 12]
+    mov cr4, eax
+
+    ; Use the kernel page directory.
+    mov eax, [TRAMPOLINE(smp_trampoline_data)]
+    mov cr3, eax
+
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+
+    mov esp, [TRAMPOLINE(smp_trampoline_data) + 4]
+
+    mov eax, [TRAMPOLINE(smp_trampoline_data) + 8]
+    call eax
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+trampoline_gdt:
+    dq 0x0000000000000000
+    dq 0x00CF9A000000FFFF ; kernel code segment
+    dq 0x00CF92000000FFFF ; kernel data segment
+
+trampoline_gdt_descriptor:
+    dw (trampoline_gdt_descriptor - trampoline_gdt) - 1
+    dd TRAMPOLINE(trampoline_gdt)
+
+; Filled by smp_setup() before starting each processor.
+align 4
+smp_trampoline_data:
+    dd 0 ; page directory
+    dd 0 ; stack
+    dd 0 ; entry point
+    dd 0 ; cr4
+
+smp_trampoline_end:
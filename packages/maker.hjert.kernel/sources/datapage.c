@@ -0,0 +1,152 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* datapage.c: Read-only pages shared with the userspace                      */
+
+/*
+ * The kernel data page is mapped in every user address space by
+ * memory_alloc_pdir(), the process data page by alloc_process().
+ *
+ * The timer updates the kernel data page each time it moves the clock
+ * forward. The wall clock is only read from the CMOS at boot, then advanced
+ * from the uptime, so nobody has to wait on the RTC anymore.
+ */
+
+#include <string.h>
+#include <skift/logger.h>
+
+#include "kernel/clock.h"
+#include "kernel/cpu/cpuid.h"
+#include "kernel/memory.h"
+#include "kernel/processor.h"
+#include "kernel/tasking.h"
+#include "kernel/timer.h"
+
+#include "kernel/datapage.h"
+
+#define TSC_CALIBRATION_US 10000
+
+kernel_datapage_t *kernel_datapage = NULL;
+
+time_t datapage_time;
+u64 datapage_next_second = 0; // Uptime when the wall clock must move forward.
+
+/* --- Kernel data page ----------------------------------------------------- */
+
+void datapage_publish_time(kernel_datapage_t *page)
+{
+    page->time.second = datapage_time.second;
+    page->time.minute = datapage_time.minute;
+    page->time.hour = datapage_time.hour;
+    page->time.day = datapage_time.day;
+    page->time.month = datapage_time.month;
+    page->time.year = datapage_time.year;
+}
+
+void datapage_setup()
+{
+    kernel_datapage_t *page = (kernel_datapage_t *)memory_alloc_identity(memory_kpdir(), 1, 0);
+    memset(page, 0, PAGE_SIZE);
+
+    if (cpuid_get_feature_EDX() & CPUID_FEAT_EDX_TSC)
+    {
+        u64 start = rdtsc();
+        timer_busy_wait(TSC_CALIBRATION_US);
+        page->tsc_per_us = (uint)(rdtsc() - start) / TSC_CALIBRATION_US;
+    }
+
+    clock_time(&datapage_time);
+    datapage_publish_time(page);
+
+    page->uptime = timer_uptime();
+    page->tsc = (u32)rdtsc();
+    datapage_next_second = page->uptime + 1000000;
+
+    kernel_datapage = page;
+
+    sk_log(LOG_DEBUG, "Kernel data page at 0x%x (TSC=%dMHz).", page, page->tsc_per_us);
+}
+
+kernel_datapage_t *datapage_kernel()
+{
+    return kernel_datapage;
+}
+
+void datapage_update(uint ticks, u64 uptime)
+{
+    kernel_datapage_t *page = kernel_datapage;
+
+    if (page == NULL)
+        return;
+
+    page->sequence++;
+    __sync_synchronize();
+
+    page->ticks = ticks;
+    page->uptime = uptime;
+    page->tsc = (u32)rdtsc();
+
+    if (uptime >= datapage_next_second)
+    {
+        while (uptime >= datapage_next_second)
+        {
+            clock_advance(&datapage_time);
+            datapage_next_second += 1000000;
+        }
+
+        datapage_publish_time(page);
+    }
+
+    __sync_synchronize();
+    page->sequence++;
+}
+
+/* --- Process data page ---------------------------------------------------- */
+
+process_datapage_t *datapage_create(page_directorie_t *pdir, int process)
+{
+    process_datapage_t *page = (process_datapage_t *)memory_alloc_identity(memory_kpdir(), 1, 0);
+    memset(page, 0, PAGE_SIZE);
+
+    page->process = process;
+    page->stack_size = STACK_SIZE;
+
+    memory_map_readonly(pdir, PROCESS_DATAPAGE_ADDRESS, (uint)page, 1);
+
+    return page;
+}
+
+void datapage_destroy(process_datapage_t *page)
+{
+    memory_free(memory_kpdir(), (uint)page, 1, 0);
+}
+
+void datapage_add_thread(process_datapage_t *page, int thread, uint stack)
+{
+    for (int i = 0; i < PROCESS_DATAPAGE_THREADS; i++)
+    {
+        if (page->threads[i].stack == 0)
+        {
+            // A reader may look at the slot, fill it before making it valid.
+            page->threads[i].thread = thread;
+            __sync_synchronize();
+            page->threads[i].stack = stack;
+
+            return;
+        }
+    }
+}
+
+void datapage_remove_thread(process_datapage_t *page, int thread)
+{
+    for (int i = 0; i < PROCESS_DATAPAGE_THREADS; i++)
+    {
+        if (page->threads[i].stack != 0 && page->threads[i].thread == thread)
+        {
+            page->threads[i].stack = 0;
+
+            return;
+        }
+    }
+}
@@ -2,13 +2,15 @@
 /* This code is licensed under the MIT License.                               */
 /* See: LICENSE.md                                                            */
 
-#include <skift/atomic.h>
 #include <skift/logger.h>
 
 #include "kernel/processor.h"
+#include "kernel/spinlock.h"
 
 #include "kernel/dev/atapio.h"
 
+spinlock_t atapio_lock = SPINLOCK("atapio");
+
 int atapio_common(u8 drive, u32 numblock, u8 count)
 {
     outb(0x1F1, 0x00);                            /* NULL byte to port 0x1F1 */
@@ -35,7 +37,7 @@ void atapio_wait()
 
 int atapio_read(u8 drive, u32 numblock, u8 count, char *buf)
 {
-    sk_atomic_begin();
+    spinlock_acquire(&atapio_lock);
     sk_log(LOG_INFO, "ATA::pio read drive:%d block:%d count:%d", drive, numblock, count);
     u16 tmpword;
     int idx;
@@ -54,14 +56,14 @@ int atapio_read(u8 drive, u32 numblock, u8 count, char *buf)
     }
 
     sk_log(LOG_INFO, "ATA::pio read done!");
-    sk_atomic_end();
+    spinlock_release(&atapio_lock);
 
     return count;
 }
 
 int atapio_write(u8 drive, u32 numblock, u8 count, char *buf)
 {
-    sk_atomic_begin();
+    spinlock_acquire(&atapio_lock);
     sk_log(LOG_INFO, "ATA::pio write drive:%d block:%d count:%d", drive, numblock, count);
 
     u16 tmpword;
@@ -79,7 +81,7 @@ int atapio_write(u8 drive, u32 numblock, u8 count, char *buf)
     }
 
     sk_log(LOG_FINE, "ATA::pio write done!");
-    sk_atomic_end();
+    spinlock_release(&atapio_lock);
 
     return count;
 }
\ No newline at end of file
@@ -52,7 +52,7 @@ void graphic_setup()
     if (physical_framebuffer != NULL)
     {
         uint page_count = PAGE_ALIGN(graphic_width * graphic_height * sizeof(uint)) / PAGE_SIZE;
-        virtual_framebuffer = (uint *)memory_alloc_at(memory_kpdir(), page_count, (uint)physical_framebuffer, 0);
+        virtual_framebuffer = (uint *)memory_alloc_at_large(memory_kpdir(), page_count, (uint)physical_framebuffer, 0);
     }
 }
 
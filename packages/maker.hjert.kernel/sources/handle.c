@@ -0,0 +1,127 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* handle.c: Generation checked handle tables                                 */
+
+#include <stdlib.h>
+#include <skift/logger.h>
+
+#include "kernel/handle.h"
+
+#define HANDLE_TABLE_INITIAL_CAPACITY 64
+
+void handle_table_grow(handle_table_t *table, int capacity)
+{
+    table->entries = realloc(table->entries, sizeof(handle_entry_t) * capacity);
+
+    // Chain the new entries in the free list.
+    for (int i = capacity - 1; i >= table->capacity; i--)
+    {
+        handle_entry_t *entry = &table->entries[i];
+
+        entry->object = NULL;
+        entry->generation = 1;
+        entry->next_free = table->free_head;
+
+        table->free_head = i;
+    }
+
+    table->capacity = capacity;
+}
+
+handle_table_t *handle_table()
+{
+    handle_table_t *table = MALLOC(handle_table_t);
+
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    table->free_head = -1;
+
+    handle_table_grow(table, HANDLE_TABLE_INITIAL_CAPACITY);
+
+    // The index 0 is never given so a handle can't be 0.
+    table->free_head = table->entries[0].next_free;
+
+    return table;
+}
+
+void handle_table_delete(handle_table_t *table)
+{
+    free(table->entries);
+    free(table);
+}
+
+int handle_alloc(handle_table_t *table, void *object)
+{
+    if (table->free_head == -1)
+    {
+        if (table->capacity > HANDLE_INDEX_MASK)
+        {
+            sk_log(LOG_WARNING, "Handle table full!");
+            return 0;
+        }
+
+        int capacity = table->capacity * 2;
+        handle_table_grow(table, capacity > HANDLE_INDEX_MASK + 1 ? HANDLE_INDEX_MASK + 1 : capacity);
+    }
+
+    int index = table->free_head;
+    handle_entry_t *entry = &table->entries[index];
+
+    table->free_head = entry->next_free;
+    table->count++;
+
+    entry->object = object;
+    entry->next_free = -1;
+
+    return HANDLE(entry->generation, index);
+}
+
+void handle_free(handle_table_t *table, int handle)
+{
+    if (handle_get(table, handle) == NULL)
+    {
+        return;
+    }
+
+    int index = HANDLE_INDEX(handle);
+    handle_entry_t *entry = &table->entries[index];
+
+    entry->object = NULL;
+    entry->generation = (entry->generation + 1) & HANDLE_GENERATION_MASK;
+
+    if (entry->generation == 0)
+    {
+        entry->generation = 1;
+    }
+
+    entry->next_free = table->free_head;
+    table->free_head = index;
+    table->count--;
+}
+
+void *handle_get(handle_table_t *table, int handle)
+{
+    if (handle <= 0)
+    {
+        return NULL;
+    }
+
+    int index = HANDLE_INDEX(handle);
+
+    if (index >= table->capacity)
+    {
+        return NULL;
+    }
+
+    handle_entry_t *entry = &table->entries[index];
+
+    if (entry->object == NULL || entry->generation != (uint)HANDLE_GENERATION(handle))
+    {
+        return NULL;
+    }
+
+    return entry->object;
+}
@@ -25,12 +25,15 @@
 #include <skift/logger.h>
 #include <skift/__plugs.h>
 
+#include "kernel/cpu/fpu.h"
 #include "kernel/cpu/gdt.h"
 #include "kernel/cpu/idt.h"
 #include "kernel/cpu/irq.h"
 #include "kernel/cpu/isr.h"
+#include "kernel/cpu/sysenter.h"
 
 #include "kernel/console.h"
+#include "kernel/datapage.h"
 #include "kernel/filesystem.h"
 #include "kernel/graphic.h"
 #include "kernel/keyboard.h"
@@ -39,8 +42,10 @@
 #include "kernel/mouse.h"
 #include "kernel/multiboot.h"
 #include "kernel/paging.h"
+#include "kernel/smp.h"
 #include "kernel/system.h"
 #include "kernel/tasking.h"
+#include "kernel/timer.h"
 #include "kernel/version.h"
 
 multiboot_info_t mbootinfo;
@@ -83,9 +88,13 @@ void main(multiboot_info_t *info, s32 magic)
     setup(idt);
     setup(isr);
     setup(irq);
+    setup(fpu);
+    setup(sysenter);
 
     /* --- System context --------------------------------------------------- */
-    setup(memory, get_kernel_end(&mbootinfo), (mbootinfo.mem_lower + mbootinfo.mem_upper) * 1024);
+    setup(memory, get_kernel_end(&mbootinfo), &mbootinfo);
+    setup(timer);
+    setup(datapage);
     setup(tasking);
     setup(filesystem);
     setup(modules, &mbootinfo);
@@ -100,6 +109,8 @@ void main(multiboot_info_t *info, s32 magic)
     sk_atomic_enable();
     sti();
 
+    setup(smp);
+
     printf(KERNEL_UNAME);
     printf("\nCopyright (c) 2018-2019 MAKER.\n");
     printf("Booting...\n");
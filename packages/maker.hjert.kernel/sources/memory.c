@@ -5,42 +5,240 @@
 /* memory.c: Physical, virtual and logical memory managment                   */
 
 /*
- * TODO:
- * - ADD: improve the allocator to prevent starving of indentity mapped pages.
+ * The physical frames bitmap is protected by `pmm_lock` and page directories
+ * by `vmm_lock`. Both are taken from interrupt handlers through the kernel
+ * heap, so interrupts are disabled while they are held. When both are needed
+ * `vmm_lock` is taken first.
+ *
+ * The kernel image is mapped in the first gigabyte of every address space and
+ * is never unmapped, its pages are marked global so their TLB entries survive
+ * address space switches. Other mappings can be in the TLB of any processor,
+ * when one of them is removed or changed the other processors are sent a
+ * shootdown and we wait until they all dropped it.
  */
 
 #include <string.h>
 #include <skift/types.h>
 #include <skift/utils.h>
-#include <skift/atomic.h>
 #include <skift/logger.h>
 
+#include "kernel/cpu/apic.h"
+#include "kernel/cpu/cpuid.h"
+#include "kernel/cpu/irq.h"
+#include "kernel/cpu/isr.h"
+#include "kernel/datapage.h"
 #include "kernel/paging.h"
+#include "kernel/processor.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
+#include "kernel/system.h"
 
 #include "kernel/memory.h"
 
-/* --- Private functions ---------------------------------------------------- */
+spinlock_t pmm_lock = SPINLOCK("pmm");
+spinlock_t vmm_lock = SPINLOCK("vmm");
+
+/* --- Physical memory managment -------------------------------------------- */
+
+/*
+ * Physical pages are tracked with a bitmap, one bit per page set when the page
+ * is used. Two summary levels keep one bit per word of the level below, set
+ * when that word is full, so the allocator skips used regions 32 or 1024
+ * words at a time and finds free pages inside a word with bsf.
+ */
+
+#define PHYSICAL_PAGES (1024 * 1024) // Enough for 4Gio of memory.
+#define PHYSICAL_WORDS (PHYSICAL_PAGES / 32)
+#define PHYSICAL_GROUPS (PHYSICAL_WORDS / 32)
+
+#define LARGE_PAGE_PAGES (LARGE_PAGE_SIZE / PAGE_SIZE)
 
 uint TOTAL_MEMORY = 0;
 uint USED_MEMORY = 0;
 
-uchar MEMORY[1024 * 1024 / 8];
+// Page following the last usable frame.
+uint PHYSICAL_END = 0;
+
+// Extra references to frames shared copy-on-write between address spaces, a
+// frame is only freed once it has none left.
+#define PHYSICAL_REFS_MAX 255
+
+u8 *MEMORY_REFS = NULL;
+
+u32 MEMORY[PHYSICAL_WORDS];
+u32 MEMORY_FULL_WORDS[PHYSICAL_GROUPS];       // One bit per word of MEMORY.
+u32 MEMORY_FULL_GROUPS[PHYSICAL_GROUPS / 32]; // One bit per word of MEMORY_FULL_WORDS.
+
+static inline uint bit_scan_forward(u32 value)
+{
+    return __builtin_ctz(value);
+}
+
+static inline uint bit_count(u32 value)
+{
+    value = value - ((value >> 1) & 0x55555555);
+    value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+    return (((value + (value >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+// Mask of `count` bits starting at `bit`, which stay in the same word.
+static inline u32 bit_mask(uint bit, uint count)
+{
+    return (count == 32 ? 0xFFFFFFFF : ((1u << count) - 1)) << bit;
+}
+
+void physical_update_summary(uint word)
+{
+    uint group = word / 32;
+
+    if (MEMORY[word] == 0xFFFFFFFF)
+        MEMORY_FULL_WORDS[group] |= 1u << (word % 32);
+    else
+        MEMORY_FULL_WORDS[group] &= ~(1u << (word % 32));
+
+    if (MEMORY_FULL_WORDS[group] == 0xFFFFFFFF)
+        MEMORY_FULL_GROUPS[group / 32] |= 1u << (group % 32);
+    else
+        MEMORY_FULL_GROUPS[group / 32] &= ~(1u << (group % 32));
+}
+
+void physical_set(uint page, uint count, bool used)
+{
+    while (count > 0 && page < PHYSICAL_PAGES)
+    {
+        uint word = page / 32;
+        uint bit = page % 32;
+        uint n = count < 32 - bit ? count : 32 - bit;
+        u32 mask = bit_mask(bit, n);
+
+        if (used)
+        {
+            USED_MEMORY += bit_count(~MEMORY[word] & mask) * PAGE_SIZE;
+            MEMORY[word] |= mask;
+        }
+        else
+        {
+            USED_MEMORY -= bit_count(MEMORY[word] & mask) * PAGE_SIZE;
+            MEMORY[word] &= ~mask;
+        }
+
+        physical_update_summary(word);
+
+        page += n;
+        count -= n;
+    }
+}
+
+// Return the first word at or after `word` with a free page.
+uint physical_next_free_word(uint word)
+{
+    while (word < PHYSICAL_WORDS)
+    {
+        uint group = word / 32;
+        u32 free = ~MEMORY_FULL_WORDS[group] & (0xFFFFFFFF << (word % 32));
+
+        if (free != 0)
+        {
+            return group * 32 + bit_scan_forward(free);
+        }
+
+        // Look for the next group which isn't full.
+        group++;
+
+        while (group < PHYSICAL_GROUPS)
+        {
+            u32 free_groups = ~MEMORY_FULL_GROUPS[group / 32] & (0xFFFFFFFF << (group % 32));
+
+            if (free_groups != 0)
+            {
+                group = (group / 32) * 32 + bit_scan_forward(free_groups);
+                break;
+            }
+
+            group = (group / 32 + 1) * 32;
+        }
+
+        word = group * 32;
+    }
+
+    return PHYSICAL_WORDS;
+}
+
+// Return the first page of a run of `count` free pages between `first` and
+// `last`, 0 if there is none.
+uint physical_find(uint first, uint last, uint count)
+{
+    uint start = 0;
+    uint length = 0;
+
+    for (uint word = physical_next_free_word(first / 32); word < PHYSICAL_WORDS && word * 32 < last;)
+    {
+        u32 used = MEMORY[word];
+        uint bit = 0;
+
+        if (word == first / 32)
+        {
+            used |= bit_mask(0, first % 32);
+        }
+
+        while (bit < 32)
+        {
+            u32 free = ~used & (0xFFFFFFFF << bit);
+
+            if (free == 0)
+            {
+                length = 0;
+                break;
+            }
+
+            uint first = bit_scan_forward(free);
+
+            if (first != bit)
+            {
+                length = 0;
+            }
+
+            if (length == 0)
+            {
+                start = word * 32 + first;
+            }
+
+            u32 after = used >> first;
+            uint run = after ? bit_scan_forward(after) : 32 - first;
+
+            length += run;
+
+            if (length >= count)
+            {
+                return start + count <= last ? start : 0;
+            }
 
-#define PHYSICAL_IS_USED(addr) \
-    (MEMORY[(uint)(addr) / PAGE_SIZE / 8] & (1 << ((uint)(addr) / PAGE_SIZE % 8)))
+            bit = first + run;
+        }
 
-#define PHYSICAL_SET_USED(addr) \
-    (MEMORY[(uint)(addr) / PAGE_SIZE / 8] |= (1 << ((uint)(addr) / PAGE_SIZE % 8)))
+        // A run can only go on in the next word, otherwise skip the full ones.
+        word = length > 0 ? word + 1 : physical_next_free_word(word + 1);
+    }
 
-#define PHYSICAL_SET_FREE(addr) \
-    (MEMORY[(uint)(addr) / PAGE_SIZE / 8] &= ~(1 << ((uint)(addr) / PAGE_SIZE % 8)))
+    return 0;
+}
 
 int physical_is_used(uint addr, uint count)
 {
-    for (uint i = 0; i < count; i++)
+    uint page = addr / PAGE_SIZE;
+
+    while (count > 0)
     {
-        if (PHYSICAL_IS_USED(addr + i * PAGE_SIZE))
+        if (page >= PHYSICAL_PAGES)
             return 1;
+
+        uint n = count < 32 - page % 32 ? count : 32 - page % 32;
+
+        if (MEMORY[page / 32] & bit_mask(page % 32, n))
+            return 1;
+
+        page += n;
+        count -= n;
     }
 
     return 0;
@@ -48,39 +246,228 @@ int physical_is_used(uint addr, uint count)
 
 void physical_set_used(uint addr, uint count)
 {
-    for (uint i = 0; i < count; i++)
-    {
-        PHYSICAL_SET_USED(addr + (i * PAGE_SIZE));
-    }
+    physical_set(addr / PAGE_SIZE, count, true);
 }
 
 void physical_set_free(uint addr, uint count)
 {
-    for (uint i = 0; i < count; i++)
+    physical_set(addr / PAGE_SIZE, count, false);
+}
+
+/*
+ * Frames are cleared ahead of time while the processors are idle, so pages can
+ * be handed out zero-filled without clearing them in the critical path. The
+ * pool frames are marked used in the bitmap but not counted by memory_used().
+ */
+
+#define ZEROED_POOL_SIZE 256 // 1Mio
+
+uint zeroed_frames[ZEROED_POOL_SIZE]; // Page numbers.
+uint zeroed_count = 0;
+
+uint zeroed_hits = 0;   // Pages served from the pool.
+uint zeroed_misses = 0; // Pages that had to be cleared on allocation.
+
+// Take a cleared frame from the pool, return 0 if it is empty.
+uint physical_alloc_zeroed()
+{
+    spinlock_acquire_irqsave(&pmm_lock);
+
+    uint page = zeroed_count > 0 ? zeroed_frames[--zeroed_count] : 0;
+
+    spinlock_release_irqrestore(&pmm_lock);
+
+    if (page != 0)
     {
-        PHYSICAL_SET_FREE(addr + (i * PAGE_SIZE));
+        __sync_fetch_and_add(&zeroed_hits, 1);
     }
+
+    return page * PAGE_SIZE;
 }
 
 uint physical_alloc(uint count)
 {
-    for (uint i = 0; i < (TOTAL_MEMORY / PAGE_SIZE); i++)
+    spinlock_acquire_irqsave(&pmm_lock);
+
+    uint page = physical_find(0, PHYSICAL_PAGES, count);
+
+    if (page != 0)
+    {
+        physical_set(page, count, true);
+    }
+    else if (count == 1 && zeroed_count > 0)
+    {
+        // Out of memory, the cleared frames are still good for anything.
+        page = zeroed_frames[--zeroed_count];
+    }
+
+    spinlock_release_irqrestore(&pmm_lock);
+
+    if (page == 0)
+    {
+        sk_log(LOG_WARNING, "alloc failed!");
+    }
+
+    return page * PAGE_SIZE;
+}
+
+void physical_free(uint addr, uint count)
+{
+    spinlock_acquire_irqsave(&pmm_lock);
+
+    for (uint page = addr / PAGE_SIZE; page < addr / PAGE_SIZE + count; page++)
     {
-        uint addr = i * PAGE_SIZE;
-        if (!physical_is_used(addr, count))
+        if (MEMORY_REFS != NULL && page < PHYSICAL_END && MEMORY_REFS[page] > 0)
+        {
+            MEMORY_REFS[page]--;
+        }
+        else
         {
-            physical_set_used(addr, count);
-            return addr;
+            physical_set(page, 1, false);
         }
     }
 
-    sk_log(LOG_WARNING, "alloc failed!");
-    return 0;
+    spinlock_release_irqrestore(&pmm_lock);
 }
 
-void physical_free(uint addr, uint count)
+// Return the address of `count` free frames aligned on a large page, 0 if there
+// is none.
+uint physical_alloc_large(uint count)
 {
-    physical_set_free(addr, count);
+    spinlock_acquire_irqsave(&pmm_lock);
+
+    uint found = 0;
+
+    // The first large page holds the kernel.
+    for (uint page = LARGE_PAGE_PAGES; page + count * LARGE_PAGE_PAGES <= PHYSICAL_PAGES; page += LARGE_PAGE_PAGES)
+    {
+        // A large page is a group of words, skip it if one of them is full.
+        if (MEMORY_FULL_WORDS[page / 32 / 32] == 0 && !physical_is_used(page * PAGE_SIZE, count * LARGE_PAGE_PAGES))
+        {
+            found = page;
+            break;
+        }
+    }
+
+    if (found != 0)
+    {
+        physical_set(found, count * LARGE_PAGE_PAGES, true);
+    }
+
+    spinlock_release_irqrestore(&pmm_lock);
+
+    return found * PAGE_SIZE;
+}
+
+// Add a reference to a frame, return false if it has too many already.
+bool physical_share(uint addr)
+{
+    spinlock_acquire_irqsave(&pmm_lock);
+
+    uint page = addr / PAGE_SIZE;
+    bool shared = page < PHYSICAL_END && MEMORY_REFS[page] < PHYSICAL_REFS_MAX;
+
+    if (shared)
+    {
+        MEMORY_REFS[page]++;
+    }
+
+    spinlock_release_irqrestore(&pmm_lock);
+
+    return shared;
+}
+
+bool physical_shared(uint addr)
+{
+    uint page = addr / PAGE_SIZE;
+
+    return page < PHYSICAL_END && MEMORY_REFS[page] > 0;
+}
+
+// Mark the frames of [start, end) free and return their size, anything above
+// 4Gio is out of reach of 32-bit paging.
+u64 physical_add_region(u64 start, u64 end)
+{
+    u64 limit = (u64)PHYSICAL_PAGES * PAGE_SIZE;
+
+    if (end > limit)
+    {
+        end = limit;
+    }
+
+    // Only whole frames are usable.
+    uint first = (start + PAGE_SIZE - 1) >> 12;
+    uint last = end >> 12;
+
+    if (start >= limit || first >= last)
+    {
+        return 0;
+    }
+
+    physical_set(first, last - first, false);
+
+    if (last > PHYSICAL_END)
+    {
+        PHYSICAL_END = last;
+    }
+
+    return (u64)(last - first) * PAGE_SIZE;
+}
+
+// Seed the bitmap with the memory the firmware reported as available, other
+// frames stay marked used so reserved holes are never handed out.
+void physical_setup(multiboot_info_t *minfo)
+{
+    memset(&MEMORY, 0, sizeof(MEMORY));
+    memset(&MEMORY_FULL_WORDS, 0, sizeof(MEMORY_FULL_WORDS));
+    memset(&MEMORY_FULL_GROUPS, 0, sizeof(MEMORY_FULL_GROUPS));
+
+    physical_set(0, PHYSICAL_PAGES, true);
+
+    u64 limit = (u64)PHYSICAL_PAGES * PAGE_SIZE;
+    u64 available = 0;
+    u64 ignored = 0; // Available memory above 4Gio.
+
+    if (minfo->flags & MULTIBOOT_INFO_MEM_MAP)
+    {
+        uint mmap = minfo->mmap_addr;
+
+        while (mmap < minfo->mmap_addr + minfo->mmap_length)
+        {
+            multiboot_memory_map_t *entry = (multiboot_memory_map_t *)mmap;
+
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE)
+            {
+                u64 start = entry->addr;
+                u64 end = entry->addr + entry->len;
+
+                available += physical_add_region(start, end);
+
+                if (end > limit)
+                {
+                    ignored += end - (start > limit ? start : limit);
+                }
+            }
+
+            // The size field doesn't count itself.
+            mmap += entry->size + sizeof(entry->size);
+        }
+    }
+    else
+    {
+        // Lower memory start at 0 and upper memory at 1Mio.
+        available += physical_add_region(0, minfo->mem_lower * 1024);
+        available += physical_add_region(0x100000, 0x100000 + (u64)minfo->mem_upper * 1024);
+    }
+
+    if (ignored > 0)
+    {
+        sk_log(LOG_WARNING, "%dMio of memory above 4Gio can't be used.", (uint)(ignored >> 20));
+    }
+
+    // Frames that aren't memory are never counted as used.
+    TOTAL_MEMORY = available;
+    USED_MEMORY = 0;
 }
 
 /* --- Virtual memory managment --------------------------------------------- */
@@ -88,231 +475,1158 @@ void physical_free(uint addr, uint count)
 #define PD_INDEX(vaddr) ((vaddr) >> 22)
 #define PT_INDEX(vaddr) (((vaddr) >> 12) & 0x03ff)
 
+#define CR0_WP (1 << 16)
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+
+// Past this many pages, reloading CR3 is cheaper than one invlpg per page.
+#define TLB_FLUSH_THRESHOLD 32
+
 page_directorie_t ALIGNED(kpdir, PAGE_SIZE);
 page_table_t ALIGNED(kptable[256], PAGE_SIZE);
 
-inline int page_present(page_directorie_t *pdir, uint vaddr)
+/* --- Virtual address ranges ----------------------------------------------- */
+
+/*
+ * Free virtual pages are kept as a sorted array of ranges, claimed by
+ * virtual_map() and given back by virtual_unmap() so they always agree with
+ * the page tables. Released ranges are merged with their neighbours.
+ *
+ * The kernel half is the same in every address space and has a single set of
+ * ranges. The user half of a page directory has its own, stored in the page
+ * following it, and the page after holds its demand ranges (see below).
+ */
+
+#define KERNEL_PAGES (256 * 1024) // The first gigabyte.
+#define VIRTUAL_RANGES 511        // Fill a page with the header.
+
+typedef struct
 {
-    uint pdi = PD_INDEX(vaddr);
-    uint pti = PT_INDEX(vaddr);
+    uint start; // In pages.
+    uint count;
+} virtual_range_t;
 
-    page_directorie_entry_t *pde = &pdir->entries[pdi];
+typedef struct
+{
+    uint count;
+    uint unused;
+    virtual_range_t ranges[VIRTUAL_RANGES];
+} virtual_ranges_t;
 
-    if (!pde->Present)
+// The last pages of the kernel half are the page table windows, one per
+// processor.
+#define WINDOW_PAGE (KERNEL_PAGES - MAX_CPU)
+
+// The page at 0 is left alone, an address of 0 means the allocation failed.
+virtual_ranges_t kernel_ranges = {.count = 1, .ranges = {{1, WINDOW_PAGE - 1}}};
+virtual_ranges_t kernel_user_ranges = {.count = 1, .ranges = {{KERNEL_PAGES, 1024 * 1024 - KERNEL_PAGES}}};
+
+static inline uint range_end(virtual_range_t *range)
+{
+    return range->start + range->count;
+}
+
+// Return the index of the first range ending at or after `page`.
+uint virtual_ranges_search(virtual_ranges_t *set, uint page)
+{
+    uint low = 0;
+    uint high = set->count;
+
+    while (low < high)
     {
-        return 0;
+        uint middle = (low + high) / 2;
+
+        if (range_end(&set->ranges[middle]) < page)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
     }
 
-    page_table_t *ptable = (page_table_t *)(pde->PageFrameNumber * PAGE_SIZE);
-    page_t *p = &ptable->pages[pti];
+    return low;
+}
 
-    if (!p->Present)
+bool virtual_ranges_insert(virtual_ranges_t *set, uint index, uint start, uint count)
+{
+    if (set->count == VIRTUAL_RANGES)
     {
-        return 0;
+        // Better lose track of some free pages than hand them out twice.
+        sk_log(LOG_WARNING, "Too many free ranges, leaking %d pages at %08x.", count, start * PAGE_SIZE);
+        return false;
     }
 
-    return 1;
+    memmove(&set->ranges[index + 1], &set->ranges[index], (set->count - index) * sizeof(virtual_range_t));
+    set->ranges[index] = (virtual_range_t){start, count};
+    set->count++;
+
+    return true;
 }
 
-int virtual_present(page_directorie_t *pdir, uint vaddr, uint count)
+void virtual_ranges_remove(virtual_ranges_t *set, uint index, uint count)
 {
-    for (uint i = 0; i < count; i++)
+    memmove(&set->ranges[index], &set->ranges[index + count], (set->count - index - count) * sizeof(virtual_range_t));
+    set->count -= count;
+}
+
+void virtual_ranges_claim(virtual_ranges_t *set, uint start, uint count)
+{
+    uint end = start + count;
+    uint index = virtual_ranges_search(set, start + 1);
+
+    while (index < set->count && set->ranges[index].start < end)
     {
-        uint offset = i * PAGE_SIZE;
+        virtual_range_t *range = &set->ranges[index];
+        uint range_start = range->start;
+        uint range_stop = range_end(range);
 
-        if (!page_present(pdir, vaddr + offset))
+        if (range_start < start && range_stop > end)
         {
-            return 0;
+            // The claimed pages are in the middle of the range, split it.
+            range->count = start - range_start;
+            virtual_ranges_insert(set, index + 1, end, range_stop - end);
+            return;
+        }
+        else if (range_start < start)
+        {
+            range->count = start - range_start;
+            index++;
+        }
+        else if (range_stop > end)
+        {
+            range->start = end;
+            range->count = range_stop - end;
+            return;
+        }
+        else
+        {
+            virtual_ranges_remove(set, index, 1);
         }
     }
-
-    return 1;
 }
 
-uint virtual2physical(page_directorie_t *pdir, uint vaddr)
+void virtual_ranges_release(virtual_ranges_t *set, uint start, uint count)
 {
-    uint pdi = PD_INDEX(vaddr);
-    uint pti = PT_INDEX(vaddr);
+    uint end = start + count;
+    uint index = virtual_ranges_search(set, start);
+    uint last = index;
 
-    page_directorie_entry_t *pde = &pdir->entries[pdi];
-    page_table_t *ptable = (page_table_t *)(pde->PageFrameNumber * PAGE_SIZE);
-    page_t *p = &ptable->pages[pti];
+    // Merge with every range overlapping or touching the released pages.
+    while (last < set->count && set->ranges[last].start <= end)
+    {
+        virtual_range_t *range = &set->ranges[last];
+
+        if (range->start < start)
+            start = range->start;
+
+        if (range_end(range) > end)
+            end = range_end(range);
+
+        last++;
+    }
+
+    if (last == index)
+    {
+        virtual_ranges_insert(set, index, start, end - start);
+    }
+    else
+    {
+        set->ranges[index] = (virtual_range_t){start, end - start};
+        virtual_ranges_remove(set, index + 1, last - index - 1);
+    }
+}
+
+virtual_ranges_t *virtual_ranges(page_directorie_t *pdir, uint page)
+{
+    if (page < KERNEL_PAGES)
+    {
+        return &kernel_ranges;
+    }
+    else if (pdir == &kpdir)
+    {
+        return &kernel_user_ranges;
+    }
+    else
+    {
+        return (virtual_ranges_t *)((uint)pdir + PAGE_SIZE);
+    }
+}
+
+void virtual_ranges_update(page_directorie_t *pdir, uint vaddr, uint count, bool free)
+{
+    uint page = vaddr / PAGE_SIZE;
+
+    // Ranges don't cross from the kernel half to the user half.
+    if (page < KERNEL_PAGES && page + count > KERNEL_PAGES)
+    {
+        virtual_ranges_update(pdir, vaddr, KERNEL_PAGES - page, free);
+        virtual_ranges_update(pdir, KERNEL_PAGES * PAGE_SIZE, page + count - KERNEL_PAGES, free);
+        return;
+    }
+
+    if (free)
+    {
+        virtual_ranges_release(virtual_ranges(pdir, page), page, count);
+    }
+    else
+    {
+        virtual_ranges_claim(virtual_ranges(pdir, page), page, count);
+    }
+}
+
+/* --- Page tables ---------------------------------------------------------- */
+
+bool global_pages = false; // The processors support CR4.PGE.
+bool large_pages = false;  // The processors support CR4.PSE.
+
+void tlb_flush_global()
+{
+    // Toggling CR4.PGE flushes the global entries too.
+    reg32_t cr4 = CR4();
+    set_cr4(cr4 & ~CR4_PGE);
+    set_cr4(cr4);
+}
+
+/*
+ * The page tables of the kernel half are the static `kptable`. Those of the
+ * user half can be in any frame, they are reached through a window: a kernel
+ * page remapped to the table being walked.
+ *
+ * Each processor has its own window, and is the only one to ever remap it. So
+ * its TLB can't hold anything but the frame it last mapped there, and the
+ * window is only remapped when the walk moves to another table.
+ */
+
+uint window_frame[MAX_CPU];
+
+page_table_t *virtual_window(uint frame)
+{
+    int cpu = cpu_self()->id;
+    uint window = (WINDOW_PAGE + cpu) * PAGE_SIZE;
+
+    if (window_frame[cpu] != frame)
+    {
+        page_t *p = &kptable[PD_INDEX(window)].pages[PT_INDEX(window)];
+
+        p->as_uint = 0;
+        p->Present = 1;
+        p->Write = 1;
+        p->PageFrameNumber = frame;
+
+        paging_invalidate_page(window);
+        window_frame[cpu] = frame;
+    }
+
+    return (page_table_t *)window;
+}
+
+// Alloc a frame filled with zeros, from the pool when it isn't empty.
+uint virtual_alloc_cleared()
+{
+    uint frame = physical_alloc_zeroed();
+
+    if (frame != 0)
+    {
+        return frame;
+    }
+
+    frame = physical_alloc(1);
+
+    if (frame != 0)
+    {
+        __sync_fetch_and_add(&zeroed_misses, 1);
+        memset(virtual_window(frame / PAGE_SIZE), 0, PAGE_SIZE);
+    }
+
+    return frame;
+}
+
+// Return the page table covering `vaddr`, NULL if there is none. It stays
+// valid until another user page table is walked.
+page_table_t *virtual_table(page_directorie_t *pdir, uint vaddr)
+{
+    uint pdi = PD_INDEX(vaddr);
+    page_directorie_entry_t *pde = &pdir->entries[pdi];
+
+    if (!pde->Present || pde->LargePage)
+    {
+        return NULL;
+    }
+
+    if (pdi < 256)
+    {
+        return &kptable[pdi];
+    }
+
+    return virtual_window(pde->PageFrameNumber);
+}
+
+bool virtual_is_large(page_directorie_t *pdir, uint vaddr)
+{
+    page_directorie_entry_t *pde = &pdir->entries[PD_INDEX(vaddr)];
+
+    return pde->Present && pde->LargePage;
+}
+
+int page_present(page_directorie_t *pdir, uint vaddr)
+{
+    if (virtual_is_large(pdir, vaddr))
+    {
+        return 1;
+    }
+
+    page_table_t *ptable = virtual_table(pdir, vaddr);
+
+    return ptable != NULL && ptable->pages[PT_INDEX(vaddr)].Present;
+}
+
+int virtual_present(page_directorie_t *pdir, uint vaddr, uint count)
+{
+    for (uint i = 0; i < count; i++)
+    {
+        uint offset = i * PAGE_SIZE;
+
+        if (!page_present(pdir, vaddr + offset))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// The page table covering `vaddr` must be present.
+page_t *virtual_page(page_directorie_t *pdir, uint vaddr)
+{
+    return &virtual_table(pdir, vaddr)->pages[PT_INDEX(vaddr)];
+}
+
+uint virtual2physical(page_directorie_t *pdir, uint vaddr)
+{
+    if (virtual_is_large(pdir, vaddr))
+    {
+        return pdir->entries[PD_INDEX(vaddr)].PageFrameNumber * PAGE_SIZE + vaddr % LARGE_PAGE_SIZE;
+    }
+
+    page_t *p = virtual_page(pdir, vaddr);
+
+    return p->PageFrameNumber * PAGE_SIZE + (vaddr & 0xfff);
+}
+
+void virtual_set_global(page_directorie_t *pdir, uint vaddr, uint count)
+{
+    for (uint i = 0; i < count; i++)
+    {
+        virtual_page(pdir, vaddr + i * PAGE_SIZE)->Global = 1;
+    }
+}
+
+void tlb_flush_local(page_directorie_t *pdir, uint vaddr, uint count, bool global)
+{
+    // The user half of another address space isn't in our TLB.
+    if (vaddr >= KERNEL_PAGES * PAGE_SIZE && (reg32_t)pdir != CR3())
+    {
+        return;
+    }
+
+    if (count <= TLB_FLUSH_THRESHOLD)
+    {
+        // invlpg also drops global entries.
+        for (uint i = 0; i < count; i++)
+        {
+            paging_invalidate_page(vaddr + i * PAGE_SIZE);
+        }
+    }
+    else if (global && global_pages)
+    {
+        tlb_flush_global();
+    }
+    else
+    {
+        paging_invalidate_tlb();
+    }
+}
+
+/*
+ * Mappings are only changed with `vmm_lock` held, so there is at most one
+ * shootdown at a time. A processor spinning on a lock with the interrupts
+ * disabled can't take the IPI, and the lock could be held by the processor
+ * waiting for it, so spinlocks also call memory_tlb_poll() while spinning.
+ */
+
+typedef struct
+{
+    page_directorie_t *pdir;
+    uint vaddr;
+    uint count;
+    bool global;
+} tlb_shootdown_t;
+
+tlb_shootdown_t shootdown;
+volatile int shootdown_pending = 0; // Processors which didn't flush yet.
+
+// Drop the TLB entries of pages that were remapped or unmapped, on every
+// processor. Called with `vmm_lock` held.
+void virtual_flush(page_directorie_t *pdir, uint vaddr, uint count, bool global)
+{
+    tlb_flush_local(pdir, vaddr, count, global);
+
+    shootdown = (tlb_shootdown_t){pdir, vaddr, count, global};
+
+    // A processor coming online after this point flushes its whole TLB.
+    __sync_synchronize();
+
+    cpu_t *self = cpu_self();
+
+    for (int i = 0; i < smp_cpu_count(); i++)
+    {
+        cpu_t *cpu = cpu_get(i);
+
+        if (cpu != self && cpu->online)
+        {
+            __sync_fetch_and_add(&shootdown_pending, 1);
+            cpu->tlb_shootdown = true;
+
+            lapic_send_ipi(cpu->apic_id, LAPIC_IPI_FIXED | (32 + IRQ_TLB_SHOOTDOWN));
+        }
+    }
+
+    while (shootdown_pending > 0)
+    {
+        asm volatile("pause");
+    }
+}
+
+reg32_t memory_tlb_shootdown(reg32_t esp, processor_context_t *context)
+{
+    UNUSED(context);
+
+    memory_tlb_poll();
+
+    return esp;
+}
+
+// Set a page table entry without flushing the TLB, return the old one.
+page_t virtual_map_page(page_directorie_t *pdir, uint vaddr, uint paddr, bool user)
+{
+    page_directorie_entry_t *pde = &pdir->entries[PD_INDEX(vaddr)];
+
+    if (!pde->Present)
+    {
+        pde->as_uint = 0;
+        pde->Present = 1;
+        pde->Write = 1;
+        pde->User = user;
+        pde->PageFrameNumber = virtual_alloc_cleared() / PAGE_SIZE;
+    }
+
+    page_t *p = virtual_page(pdir, vaddr);
+    page_t old = *p;
+
+    p->as_uint = 0;
+    p->Present = 1;
+    p->User = user;
+    p->Write = 1;
+    p->PageFrameNumber = paddr >> 12;
+
+    return old;
+}
+
+// Clear a page table entry without flushing the TLB, return the old one.
+page_t virtual_unmap_page(page_directorie_t *pdir, uint vaddr)
+{
+    page_t old = {.as_uint = 0};
+
+    if (pdir->entries[PD_INDEX(vaddr)].Present)
+    {
+        page_t *p = virtual_page(pdir, vaddr);
+
+        old = *p;
+        p->as_uint = 0;
+    }
+
+    return old;
+}
+
+int virtual_map(page_directorie_t *pdir, uint vaddr, uint paddr, uint count, bool user)
+{
+    bool remapped = false;
+    bool global = false;
+
+    virtual_ranges_update(pdir, vaddr, count, false);
+
+    for (uint i = 0; i < count; i++)
+    {
+        uint offset = i * PAGE_SIZE;
+        page_t old = virtual_map_page(pdir, vaddr + offset, paddr + offset, user);
+
+        remapped |= old.Present;
+        global |= old.Global;
+    }
+
+    // Not-present entries are never cached, so only a remap needs a flush.
+    if (remapped)
+    {
+        virtual_flush(pdir, vaddr, count, global);
+    }
+
+    return 0;
+}
+
+void virtual_unmap(page_directorie_t *pdir, uint vaddr, uint count)
+{
+    bool unmapped = false;
+    bool global = false;
+
+    virtual_ranges_update(pdir, vaddr, count, true);
+
+    for (uint i = 0; i < count; i++)
+    {
+        page_t old = virtual_unmap_page(pdir, vaddr + i * PAGE_SIZE);
+
+        unmapped |= old.Present;
+        global |= old.Global;
+    }
+
+    if (unmapped)
+    {
+        virtual_flush(pdir, vaddr, count, global);
+    }
+}
+
+/* --- Large pages ---------------------------------------------------------- */
+
+/*
+ * With CR4.PSE a page directory entry can map a 4Mio page, which takes a single
+ * TLB entry instead of 1024. They are used for the kernel image, the
+ * framebuffer and the allocations asking for them. Large pages are mapped and
+ * copied as a whole, they are never filled on demand nor shared copy-on-write.
+ *
+ * The kernel half of the page directory is copied in every new one, so its
+ * entries can only become large pages until the first copy is made.
+ */
+
+bool kernel_half_copied = false;
+
+bool virtual_can_map_large(int user)
+{
+    return large_pages && (user || !kernel_half_copied);
+}
+
+// Return the address of `count` free large pages, 0 if there is none.
+uint virtual_find_large(page_directorie_t *pdir, uint count, int user)
+{
+    virtual_ranges_t *set = virtual_ranges(pdir, user ? KERNEL_PAGES : 0);
+
+    for (uint i = 0; i < set->count; i++)
+    {
+        virtual_range_t *range = &set->ranges[i];
+        uint start = (range->start + LARGE_PAGE_PAGES - 1) / LARGE_PAGE_PAGES * LARGE_PAGE_PAGES;
+
+        if (start + count * LARGE_PAGE_PAGES <= range_end(range))
+        {
+            return start * PAGE_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+// Both addresses must be aligned on a large page and the range must be free.
+void virtual_map_large(page_directorie_t *pdir, uint vaddr, uint paddr, uint count, bool user)
+{
+    virtual_ranges_update(pdir, vaddr, count * LARGE_PAGE_PAGES, false);
+
+    for (uint i = 0; i < count; i++)
+    {
+        uint pdi = PD_INDEX(vaddr) + i;
+        page_directorie_entry_t *pde = &pdir->entries[pdi];
+
+        // The range is free, so a page table there is empty.
+        uint table = pdi >= 256 && pde->Present ? pde->PageFrameNumber * PAGE_SIZE : 0;
+
+        pde->as_uint = 0;
+        pde->Present = 1;
+        pde->Write = 1;
+        pde->User = user;
+        pde->LargePage = 1;
+        pde->PageFrameNumber = (paddr + i * LARGE_PAGE_SIZE) / PAGE_SIZE;
+
+        if (table != 0)
+        {
+            // The processors may still walk the old table through their
+            // paging-structure caches, which invlpg drops, it can only be
+            // reused once they all did.
+            virtual_flush(pdir, pdi * LARGE_PAGE_SIZE, 1, false);
+            physical_free(table, 1);
+        }
+    }
+}
+
+// Unmap the large page covering `vaddr`, return the address of its frames.
+uint virtual_unmap_large(page_directorie_t *pdir, uint vaddr)
+{
+    uint pdi = PD_INDEX(vaddr);
+    page_directorie_entry_t *pde = &pdir->entries[pdi];
+
+    uint paddr = pde->PageFrameNumber * PAGE_SIZE;
+    bool global = pde->Global;
+
+    pde->as_uint = 0;
+
+    if (pdi < 256)
+    {
+        // The kernel half always has its page tables.
+        pde->Present = 1;
+        pde->Write = 1;
+        pde->PageFrameNumber = (uint)&kptable[pdi] / PAGE_SIZE;
+    }
+
+    virtual_ranges_update(pdir, pdi * LARGE_PAGE_SIZE, LARGE_PAGE_PAGES, true);
+
+    // invlpg drops the entry of the whole large page.
+    virtual_flush(pdir, pdi * LARGE_PAGE_SIZE, 1, global);
+
+    return paddr;
+}
+
+// Large pages are too big to be copied on write, the child gets its copy
+// right away, in small pages if there is no free large one. Return false if
+// we ran out of memory, the pages copied so far are mapped in the child.
+bool virtual_clone_large(page_directorie_t *child, uint vaddr)
+{
+    uint paddr = physical_alloc_large(1);
+
+    for (uint i = 0; i < LARGE_PAGE_PAGES; i++)
+    {
+        uint frame = paddr != 0 ? paddr + i * PAGE_SIZE : physical_alloc(1);
+
+        if (frame == 0)
+            return false;
+
+        memcpy(virtual_window(frame / PAGE_SIZE), (void *)(vaddr + i * PAGE_SIZE), PAGE_SIZE);
+
+        if (paddr == 0)
+        {
+            virtual_map_page(child, vaddr + i * PAGE_SIZE, frame, true);
+        }
+    }
+
+    if (paddr != 0)
+    {
+        virtual_map_large(child, vaddr, paddr, 1, true);
+    }
+
+    return true;
+}
+
+// Return the address of `count` free pages in the kernel or user half, 0 if
+// there is no such range.
+uint virtual_find(page_directorie_t *pdir, uint count, int user)
+{
+    virtual_ranges_t *set = virtual_ranges(pdir, user ? KERNEL_PAGES : 0);
+
+    for (uint i = 0; i < set->count; i++)
+    {
+        if (set->ranges[i].count >= count)
+        {
+            return set->ranges[i].start * PAGE_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+uint virtual_alloc(page_directorie_t *pdir, uint paddr, uint count, int user)
+{
+    if (count == 0)
+        return 0;
+
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    uint vaddr = virtual_find(pdir, count, user);
+
+    if (vaddr != 0)
+    {
+        virtual_map(pdir, vaddr, paddr, count, user);
+    }
+
+    spinlock_release_irqrestore(&vmm_lock);
+
+    if (vaddr == 0)
+    {
+        sk_log(LOG_WARNING, "alloc failed!");
+    }
+
+    return vaddr;
+}
+
+void virtual_free(page_directorie_t *pdir, uint vaddr, uint count)
+{
+    // TODO: Check if the memory was allocated with ´virtual_alloc´.
+    spinlock_acquire_irqsave(&vmm_lock);
+    virtual_unmap(pdir, vaddr, count);
+    spinlock_release_irqrestore(&vmm_lock);
+}
+
+/* --- Demand paging -------------------------------------------------------- */
+
+/*
+ * User memory is only reserved when it is allocated or mapped: its pages are
+ * added to the demand ranges of the address space and mapped by the page fault
+ * handler. A read maps the shared zero page read-only, a write maps a zeroed
+ * frame of its own.
+ *
+ * Cloned address spaces share their frames read-only, marked copy-on-write,
+ * and the first of them writing to a page gets a copy of it.
+ *
+ * Faults are resolved against the loaded page directory, which is also the
+ * one the kernel is working with when it touches user memory.
+ */
+
+#define PAGE_FAULT 14
+#define PAGE_FAULT_WRITE (1 << 1)
+
+uint zero_page = 0;
+
+virtual_ranges_t kernel_user_demand = {.count = 0};
+
+virtual_ranges_t *virtual_demand(page_directorie_t *pdir)
+{
+    if (pdir == &kpdir)
+    {
+        return &kernel_user_demand;
+    }
+    else
+    {
+        return (virtual_ranges_t *)((uint)pdir + 2 * PAGE_SIZE);
+    }
+}
+
+bool virtual_demanded(page_directorie_t *pdir, uint page)
+{
+    virtual_ranges_t *set = virtual_demand(pdir);
+    uint index = virtual_ranges_search(set, page + 1);
+
+    return index < set->count && set->ranges[index].start <= page;
+}
+
+// Reserve user pages, those which aren't present are mapped on the first fault.
+void virtual_reserve(page_directorie_t *pdir, uint vaddr, uint count)
+{
+    virtual_ranges_update(pdir, vaddr, count, false);
+    virtual_ranges_release(virtual_demand(pdir), vaddr / PAGE_SIZE, count);
+}
+
+// Give the address space its own copy of a copy-on-write page.
+bool virtual_unshare(page_directorie_t *pdir, uint vaddr, page_t *p)
+{
+    uint frame = p->PageFrameNumber * PAGE_SIZE;
+
+    if (!physical_shared(frame))
+    {
+        // Everybody else let go of the frame, it's ours now.
+        p->Write = 1;
+        p->CopyOnWrite = 0;
+
+        paging_invalidate_page(vaddr);
+        return true;
+    }
+
+    uint copy = physical_alloc(1);
+
+    if (copy == 0)
+    {
+        return false;
+    }
+
+    memcpy(virtual_window(copy / PAGE_SIZE), (void *)vaddr, PAGE_SIZE);
+    virtual_map(pdir, vaddr, copy, 1, true);
+
+    physical_free(frame, 1);
+
+    return true;
+}
+
+bool virtual_fault(page_directorie_t *pdir, uint vaddr, bool write)
+{
+    uint page = vaddr / PAGE_SIZE;
+    vaddr = page * PAGE_SIZE;
+
+    if (page < KERNEL_PAGES || virtual_is_large(pdir, vaddr))
+    {
+        return false;
+    }
+
+    page_t *p = page_present(pdir, vaddr) ? virtual_page(pdir, vaddr) : NULL;
+
+    if (p != NULL && (p->Write || !write))
+    {
+        // Another processor resolved the fault while our TLB still held the
+        // old entry.
+        paging_invalidate_page(vaddr);
+        return true;
+    }
+
+    if (p != NULL && p->CopyOnWrite)
+    {
+        return virtual_unshare(pdir, vaddr, p);
+    }
+
+    if (!virtual_demanded(pdir, page))
+    {
+        return false;
+    }
+
+    if (p != NULL && p->PageFrameNumber != zero_page / PAGE_SIZE)
+    {
+        return false;
+    }
+
+    if (!write)
+    {
+        // Reads are served by the zero page until the first write.
+        virtual_map(pdir, vaddr, zero_page, 1, true);
+
+        p = virtual_page(pdir, vaddr);
+        p->Write = 0;
+        p->Shared = 1;
+
+        return true;
+    }
+
+    // The frame is cleared before anybody can see it.
+    uint frame = virtual_alloc_cleared();
+
+    if (frame == 0)
+    {
+        return false;
+    }
+
+    virtual_map(pdir, vaddr, frame, 1, true);
+
+    return true;
+}
+
+void memory_page_fault(processor_context_t *context)
+{
+    uint vaddr = CR2();
+
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    bool resolved = virtual_fault((page_directorie_t *)CR3(), vaddr, context->errcode & PAGE_FAULT_WRITE);
+
+    spinlock_release_irqrestore(&vmm_lock);
+
+    if (!resolved)
+    {
+        CPANIC(context, "PAGE FAULT at %08x (ERR:%x) !", vaddr, context->errcode);
+    }
+}
+
+/* --- Public functions ----------------------------------------------------- */
+
+void memory_setup(uint used, multiboot_info_t *minfo)
+{
+    physical_setup(minfo);
+
+    // Setup the kernel pagedirectorie.
+    for (uint i = 0; i < 256; i++)
+    {
+        page_directorie_entry_t *e = &kpdir.entries[i];
+        e->User = 0;
+        e->Write = 1;
+        e->Present = 1;
+        e->PageFrameNumber = (uint)&kptable[i] / PAGE_SIZE;
+    }
+
+    global_pages = cpuid_get_feature_EDX() & CPUID_FEAT_EDX_PGE;
+    large_pages = cpuid_get_feature_EDX() & CPUID_FEAT_EDX_PSE;
+
+    // Map the kernel memory
+    uint kernel_pages = PAGE_ALIGN(used) / PAGE_SIZE + 1;
+
+    if (large_pages)
+    {
+        // The frames following the kernel in its last large page stay free,
+        // they are only reachable through it by the kernel.
+        uint count = (kernel_pages + LARGE_PAGE_PAGES - 1) / LARGE_PAGE_PAGES;
+
+        physical_set_used(0, kernel_pages);
+        virtual_map_large(&kpdir, 0, 0, count, false);
+
+        for (uint i = 0; i < count; i++)
+        {
+            kpdir.entries[i].Global = global_pages;
+        }
+    }
+    else
+    {
+        memory_identity_map(&kpdir, 0, kernel_pages);
+
+        if (global_pages)
+        {
+            virtual_set_global(&kpdir, 0, kernel_pages);
+        }
+    }
+
+    // Large pages must be enabled before the first access through them.
+    paging_load_directorie(&kpdir);
+    memory_enable();
+    paging_enable();
+
+    zero_page = memory_alloc_identity(&kpdir, 1, 0);
+    memset((void *)zero_page, 0, PAGE_SIZE);
+
+    uint refs_pages = (PHYSICAL_END + PAGE_SIZE - 1) / PAGE_SIZE;
+    MEMORY_REFS = (u8 *)memory_alloc_identity(&kpdir, refs_pages, 0);
+    memset(MEMORY_REFS, 0, refs_pages * PAGE_SIZE);
+
+    isr_register(PAGE_FAULT, memory_page_fault);
+    irq_register(IRQ_TLB_SHOOTDOWN, memory_tlb_shootdown);
+}
+
+void memory_enable()
+{
+    // Also catch the kernel writing to read-only pages.
+    set_cr0(CR0() | CR0_WP);
+
+    if (global_pages)
+    {
+        set_cr4(CR4() | CR4_PGE);
+    }
+
+    if (large_pages)
+    {
+        set_cr4(CR4() | CR4_PSE);
+    }
+}
+
+uint memory_used()
+{
+    return USED_MEMORY - zeroed_count * PAGE_SIZE;
+}
+
+uint memory_total()
+{
+    return TOTAL_MEMORY;
+}
+
+void memory_tlb_poll()
+{
+    cpu_t *cpu = cpu_self();
 
-    return ((p->PageFrameNumber & ~0xfff) + (vaddr & 0xfff));
+    // The IPI can come in while we are polling, only one of them flushes.
+    if (cpu->tlb_shootdown && __sync_bool_compare_and_swap(&cpu->tlb_shootdown, true, false))
+    {
+        tlb_flush_local(shootdown.pdir, shootdown.vaddr, shootdown.count, shootdown.global);
+        __sync_fetch_and_sub(&shootdown_pending, 1);
+    }
 }
 
-int virtual_map(page_directorie_t *pdir, uint vaddr, uint paddr, uint count, bool user)
+bool memory_clear_frame()
 {
-    for (uint i = 0; i < count; i++)
-    {
-        uint offset = i * PAGE_SIZE;
+    // Like every user of the windows, hold the vmm lock, it also keeps us on
+    // this processor.
+    spinlock_acquire_irqsave(&vmm_lock);
+    spinlock_acquire_irqsave(&pmm_lock);
 
-        uint pdi = PD_INDEX(vaddr + offset);
-        uint pti = PT_INDEX(vaddr + offset);
+    // Not physical_alloc(), running out of memory here isn't worth a warning.
+    uint page = zeroed_count < ZEROED_POOL_SIZE ? physical_find(0, PHYSICAL_PAGES, 1) : 0;
 
-        page_directorie_entry_t *pde = &pdir->entries[pdi];
-        page_table_t *ptable = (page_table_t *)(pde->PageFrameNumber * PAGE_SIZE);
+    if (page != 0)
+    {
+        physical_set(page, 1, true);
+    }
 
-        if (!pde->Present)
-        {
-            ptable = (page_table_t *)memory_alloc_identity(pdir, 1, 0);
+    spinlock_release_irqrestore(&pmm_lock);
 
-            pde->Present = 1;
-            pde->Write = 1;
-            pde->User = user;
-            pde->PageFrameNumber = (u32)(ptable) >> 12;
-        }
+    if (page != 0)
+    {
+        memset(virtual_window(page), 0, PAGE_SIZE);
 
-        page_t *p = &ptable->pages[pti];
-        p->Present = 1;
-        p->User = user;
-        p->Write = 1;
-        p->PageFrameNumber = (paddr + offset) >> 12;
+        // The pool can't fill up behind our back, we hold the vmm lock.
+        spinlock_acquire_irqsave(&pmm_lock);
+        zeroed_frames[zeroed_count++] = page;
+        spinlock_release_irqrestore(&pmm_lock);
     }
 
-    paging_invalidate_tlb();
+    spinlock_release_irqrestore(&vmm_lock);
 
-    return 0;
+    return page != 0;
 }
 
-void virtual_unmap(page_directorie_t *pdir, uint vaddr, uint count)
+uint memory_zeroed_hits()
 {
-    for (uint i = 0; i < count; i++)
-    {
-        uint offset = i * PAGE_SIZE;
-
-        uint pdi = PD_INDEX(vaddr + offset);
-        uint pti = PT_INDEX(vaddr + offset);
-
-        page_directorie_entry_t *pde = &pdir->entries[pdi];
-        page_table_t *ptable = (page_table_t *)(pde->PageFrameNumber * PAGE_SIZE);
-        page_t *p = &ptable->pages[pti];
+    return zeroed_hits;
+}
 
-        if (pde->Present)
-            p->as_uint = 0;
-    }
+uint memory_zeroed_misses()
+{
+    return zeroed_misses;
+}
 
-    paging_invalidate_tlb();
+page_directorie_t *memory_kpdir()
+{
+    return &kpdir;
 }
 
-uint virtual_alloc(page_directorie_t *pdir, uint paddr, uint count, int user)
+uint memory_alloc(page_directorie_t *pdir, uint count, int user)
 {
     if (count == 0)
         return 0;
 
-    uint current_size = 0;
-    uint startaddr = 0;
+    spinlock_acquire_irqsave(&vmm_lock);
 
-    for (size_t i = (user ? 256 : 0) * 1024; i < (user ? 1024 : 256) * 1024; i++)
+    if (user)
     {
-        int vaddr = i * PAGE_SIZE;
+        uint vaddr = virtual_find(pdir, count, user);
 
-        if (!page_present(pdir, vaddr))
+        if (vaddr != 0)
         {
-            if (current_size == 0)
-            {
-                startaddr = vaddr;
-            }
+            virtual_reserve(pdir, vaddr, count);
+        }
 
-            current_size++;
+        spinlock_release_irqrestore(&vmm_lock);
 
-            if (current_size == count)
-            {
-                virtual_map(pdir, startaddr, paddr, count, user);
-                return startaddr;
-            }
-        }
-        else
+        if (vaddr == 0)
         {
-            current_size = 0;
+            sk_log(LOG_WARNING, "alloc failed!");
         }
+
+        return vaddr;
     }
 
-    sk_log(LOG_WARNING, "alloc failed!");
-    return 0;
-}
+    uint vaddr = virtual_find(pdir, count, user);
 
-void virtual_free(page_directorie_t *pdir, uint vaddr, uint count)
-{
-    // TODO: Check if the memory was allocated with ´virtual_alloc´.
-    virtual_unmap(pdir, vaddr, count);
-}
+    if (vaddr == 0)
+    {
+        spinlock_release_irqrestore(&vmm_lock);
 
-/* --- Public functions ----------------------------------------------------- */
+        sk_log(LOG_WARNING, "alloc failed!");
+        return 0;
+    }
 
-void memory_setup(uint used, uint total)
-{
-    TOTAL_MEMORY = total;
+    // Start with the frames of the zeroed pool, the rest of the memory is
+    // cleared once the lock is released.
+    uint cleared = 0;
 
-    memset(&MEMORY, 0, sizeof(MEMORY));
+    while (cleared < count)
+    {
+        uint frame = physical_alloc_zeroed();
 
-    // Setup the kernel pagedirectorie.
-    for (uint i = 0; i < 256; i++)
+        if (frame == 0)
+            break;
+
+        virtual_map(pdir, vaddr + cleared * PAGE_SIZE, frame, 1, user);
+        cleared++;
+    }
+
+    if (cleared < count)
     {
-        page_directorie_entry_t *e = &kpdir.entries[i];
-        e->User = 0;
-        e->Write = 1;
-        e->Present = 1;
-        e->PageFrameNumber = (uint)&kptable[i] / PAGE_SIZE;
+        uint paddr = physical_alloc(count - cleared);
+
+        if (paddr == 0)
+        {
+            memory_free(pdir, vaddr, cleared, user);
+            spinlock_release_irqrestore(&vmm_lock);
+
+            sk_log(LOG_WARNING, "alloc failed!");
+            return 0;
+        }
+
+        virtual_map(pdir, vaddr + cleared * PAGE_SIZE, paddr, count - cleared, user);
+        __sync_fetch_and_add(&zeroed_misses, count - cleared);
     }
 
-    // Map the kernel memory
-    memory_identity_map(&kpdir, 0, PAGE_ALIGN(used) / PAGE_SIZE + 1);
+    spinlock_release_irqrestore(&vmm_lock);
 
-    paging_load_directorie(&kpdir);
-    paging_enable();
+    memset((void *)(vaddr + cleared * PAGE_SIZE), 0, (count - cleared) * PAGE_SIZE);
+
+    return vaddr;
 }
 
-page_directorie_t *memory_kpdir()
+uint memory_alloc_at(page_directorie_t *pdir, uint count, uint paddr, int user)
 {
-    return &kpdir;
+    if (count == 0)
+        return 0;
+
+    uint vaddr = virtual_alloc(pdir, paddr, count, user);
+
+    memset((void *)vaddr, 0, count * PAGE_SIZE);
+
+    return vaddr;
 }
 
-uint memory_alloc(page_directorie_t *pdir, uint count, int user)
+// Alloc memory backed by large pages when possible, it is mapped and cleared
+// right away. The memory of a user address space must be loaded.
+uint memory_alloc_large(page_directorie_t *pdir, uint count, int user)
 {
     if (count == 0)
         return 0;
 
-    sk_atomic_begin();
+    uint large_count = (count + LARGE_PAGE_PAGES - 1) / LARGE_PAGE_PAGES;
+    uint vaddr = 0;
 
-    uint paddr = physical_alloc(count);
+    spinlock_acquire_irqsave(&vmm_lock);
 
-    if (paddr == 0)
+    if (virtual_can_map_large(user))
     {
-        sk_atomic_end();
+        vaddr = virtual_find_large(pdir, large_count, user);
+        uint paddr = vaddr != 0 ? physical_alloc_large(large_count) : 0;
 
-        sk_log(LOG_WARNING, "alloc failed!");
-        return 0;
+        if (paddr != 0)
+        {
+            virtual_map_large(pdir, vaddr, paddr, large_count, user);
+        }
+        else
+        {
+            vaddr = 0;
+        }
     }
 
-    uint vaddr = virtual_alloc(pdir, paddr, count, user);
+    spinlock_release_irqrestore(&vmm_lock);
 
     if (vaddr == 0)
     {
-        physical_free(paddr, count);
-        sk_atomic_end();
-
-        sk_log(LOG_WARNING, "alloc failed!");
-        return 0;
+        return memory_alloc(pdir, count, user);
     }
 
-    sk_atomic_end();
-
-    memset((void *)vaddr, 0, count * PAGE_SIZE);
+    memset((void *)vaddr, 0, large_count * LARGE_PAGE_SIZE);
 
     return vaddr;
 }
 
-uint memory_alloc_at(page_directorie_t *pdir, uint count, uint paddr, int user)
+// Same as memory_alloc_at(), with large pages when `paddr` is aligned on one,
+// the mapping is then rounded up to a whole large page.
+uint memory_alloc_at_large(page_directorie_t *pdir, uint count, uint paddr, int user)
 {
     if (count == 0)
         return 0;
 
-    sk_atomic_begin();
+    uint large_count = (count + LARGE_PAGE_PAGES - 1) / LARGE_PAGE_PAGES;
+    uint vaddr = 0;
 
-    uint vaddr = virtual_alloc(pdir, paddr, count, user);
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    if (virtual_can_map_large(user) && paddr % LARGE_PAGE_SIZE == 0)
+    {
+        vaddr = virtual_find_large(pdir, large_count, user);
+
+        if (vaddr != 0)
+        {
+            virtual_map_large(pdir, vaddr, paddr, large_count, user);
+        }
+    }
+
+    spinlock_release_irqrestore(&vmm_lock);
 
-    sk_atomic_end();
+    if (vaddr == 0)
+    {
+        return memory_alloc_at(pdir, count, paddr, user);
+    }
 
     memset((void *)vaddr, 0, count * PAGE_SIZE);
 
@@ -325,41 +1639,37 @@ uint memory_alloc_identity(page_directorie_t *pdir, uint count, int user)
     if (count == 0)
         return 0;
 
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&vmm_lock);
+    spinlock_acquire_irqsave(&pmm_lock);
 
-    uint current_size = 0;
-    uint startaddr = 0;
+    virtual_ranges_t *set = virtual_ranges(pdir, user ? KERNEL_PAGES : 0);
 
-    for (size_t i = (user ? 256 : 0); i < (user ? 1024 : 256) * 1024; i++)
+    // Look for free frames with the same addresses as a free virtual range.
+    for (uint i = 0; i < set->count; i++)
     {
-        int addr = i * PAGE_SIZE;
+        virtual_range_t *range = &set->ranges[i];
 
-        if (!(page_present(pdir, addr) || physical_is_used(addr, 1)))
-        {
-            if (current_size == 0)
-            {
-                startaddr = addr;
-            }
+        if (range->count < count)
+            continue;
 
-            current_size++;
+        uint page = physical_find(range->start, range_end(range), count);
 
-            if (current_size == count)
-            {
-                physical_set_used(startaddr, count);
-                virtual_map(pdir, startaddr, startaddr, count, user);
+        if (page != 0)
+        {
+            uint startaddr = page * PAGE_SIZE;
 
-                sk_atomic_end();
+            physical_set_used(startaddr, count);
+            spinlock_release_irqrestore(&pmm_lock);
 
-                return startaddr;
-            }
-        }
-        else
-        {
-            current_size = 0;
+            virtual_map(pdir, startaddr, startaddr, count, user);
+            spinlock_release_irqrestore(&vmm_lock);
+
+            return startaddr;
         }
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&pmm_lock);
+    spinlock_release_irqrestore(&vmm_lock);
 
     sk_log(LOG_WARNING, "alloc failed!");
     return 0;
@@ -369,32 +1679,67 @@ void memory_free(page_directorie_t *pdir, uint addr, uint count, int user)
 {
     UNUSED(user);
 
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    for (uint i = 0; i < count; i++)
+    {
+        uint vaddr = addr + i * PAGE_SIZE;
+
+        if (virtual_is_large(pdir, vaddr))
+        {
+            // Large pages are freed as a whole.
+            physical_free(virtual_unmap_large(pdir, vaddr), LARGE_PAGE_PAGES);
+            i += LARGE_PAGE_PAGES - 1 - PT_INDEX(vaddr);
+        }
+        else if (page_present(pdir, vaddr))
+        {
+            page_t *p = virtual_page(pdir, vaddr);
+
+            if (!p->Shared)
+            {
+                physical_free(p->PageFrameNumber * PAGE_SIZE, 1);
+            }
+        }
+    }
 
-    physical_free(addr, count);
     virtual_unmap(pdir, addr, count);
 
-    sk_atomic_end();
+    if (addr / PAGE_SIZE >= KERNEL_PAGES)
+    {
+        virtual_ranges_claim(virtual_demand(pdir), addr / PAGE_SIZE, count);
+    }
+
+    spinlock_release_irqrestore(&vmm_lock);
 }
 
 // Alloc a pdir for a process
 page_directorie_t *memory_alloc_pdir()
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&vmm_lock);
 
-    page_directorie_t *pdir = (page_directorie_t *)memory_alloc_identity(&kpdir, 1, 0);
+    // The pages following the page directory hold its free and demand ranges.
+    page_directorie_t *pdir = (page_directorie_t *)memory_alloc_identity(&kpdir, 3, 0);
+
+    virtual_ranges_t *ranges = virtual_ranges(pdir, KERNEL_PAGES);
+    ranges->count = 1;
+    ranges->ranges[0] = (virtual_range_t){KERNEL_PAGES, 1024 * 1024 - KERNEL_PAGES};
+
+    virtual_demand(pdir)->count = 0;
 
     // Copy first gigs of virtual memory (kernel space);
     for (uint i = 0; i < 256; i++)
     {
-        page_directorie_entry_t *e = &pdir->entries[i];
-        e->User = 0;
-        e->Write = 1;
-        e->Present = 1;
-        e->PageFrameNumber = (uint)&kptable[i] / PAGE_SIZE;
+        pdir->entries[i] = kpdir.entries[i];
+    }
+
+    kernel_half_copied = true;
+
+    if (datapage_kernel() != NULL)
+    {
+        memory_map_readonly(pdir, KERNEL_DATAPAGE_ADDRESS, (uint)datapage_kernel(), 1);
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&vmm_lock);
 
     return pdir;
 }
@@ -402,87 +1747,283 @@ page_directorie_t *memory_alloc_pdir()
 // Free the pdir of a dying process
 void memory_free_pdir(page_directorie_t *pdir)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&vmm_lock);
 
     for (size_t i = 256; i < 1024; i++)
     {
         page_directorie_entry_t *e = &pdir->entries[i];
 
-        if (e->Present)
+        if (e->Present && e->LargePage)
+        {
+            physical_free(e->PageFrameNumber * PAGE_SIZE, LARGE_PAGE_PAGES);
+        }
+        else if (e->Present)
         {
-            page_table_t *pt = (page_table_t *)(e->PageFrameNumber * PAGE_SIZE);
+            page_table_t *pt = virtual_window(e->PageFrameNumber);
 
             for (size_t i = 0; i < 1024; i++)
             {
                 page_t *p = &pt->pages[i];
 
-                if (p->Present)
+                if (p->Present && !p->Shared)
                 {
                     physical_free(p->PageFrameNumber * PAGE_SIZE, 1);
                 }
             }
 
-            memory_free(&kpdir, (uint)pt, 1, 0);
+            physical_free(e->PageFrameNumber * PAGE_SIZE, 1);
+        }
+    }
+    memory_free(&kpdir, (uint)pdir, 3, 0);
+
+    spinlock_release_irqrestore(&vmm_lock);
+}
+
+// Used to build a page table of the child while the one of the parent is in
+// the window, protected by `vmm_lock`.
+page_table_t clone_table;
+u32 clone_copies[PAGE_TABLE_ENTRY_COUNT / 32]; // Pages which couldn't be shared.
+
+// Give `child` the user memory of `parent`, which must be the loaded page
+// directory. Their frames are shared copy-on-write. Return -1 if we ran out of
+// memory, the child is left incomplete and must be freed.
+int memory_clone_pdir(page_directorie_t *child, page_directorie_t *parent)
+{
+    if (parent == &kpdir)
+    {
+        return -1;
+    }
+
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    memcpy(virtual_ranges(child, KERNEL_PAGES), virtual_ranges(parent, KERNEL_PAGES), sizeof(virtual_ranges_t));
+    memcpy(virtual_demand(child), virtual_demand(parent), sizeof(virtual_ranges_t));
+
+    bool shared = false;
+    bool failed = false;
+
+    for (uint pdi = 256; pdi < 1024 && !failed; pdi++)
+    {
+        if (!parent->entries[pdi].Present)
+            continue;
+
+        if (parent->entries[pdi].LargePage)
+        {
+            failed = !virtual_clone_large(child, pdi * LARGE_PAGE_SIZE);
+            continue;
+        }
+
+        page_table_t *ptable = virtual_window(parent->entries[pdi].PageFrameNumber);
+
+        memset(&clone_table, 0, sizeof(clone_table));
+        memset(&clone_copies, 0, sizeof(clone_copies));
+
+        for (uint pti = 0; pti < 1024; pti++)
+        {
+            page_t *p = &ptable->pages[pti];
+
+            if (!p->Present || (p->Shared && p->PageFrameNumber != zero_page / PAGE_SIZE))
+            {
+                // The child has its own data pages.
+                continue;
+            }
+
+            if (!p->Shared)
+            {
+                if (physical_share(p->PageFrameNumber * PAGE_SIZE))
+                {
+                    p->Write = 0;
+                    p->CopyOnWrite = 1;
+                    shared = true;
+                }
+                else
+                {
+                    // Too many references to the frame, copied below.
+                    clone_copies[pti / 32] |= 1u << (pti % 32);
+                }
+            }
+
+            clone_table.pages[pti] = *p;
+        }
+
+        for (uint pti = 0; pti < 1024; pti++)
+        {
+            page_t *entry = &clone_table.pages[pti];
+            uint vaddr = (pdi * 1024 + pti) * PAGE_SIZE;
+
+            if (clone_copies[pti / 32] & (1u << (pti % 32)))
+            {
+                uint copy = failed ? 0 : physical_alloc(1);
+
+                if (copy != 0)
+                {
+                    memcpy(virtual_window(copy / PAGE_SIZE), (void *)vaddr, PAGE_SIZE);
+                }
+
+                // The shared pages of the table are still mapped below, so
+                // freeing the child drops their references.
+                failed |= copy == 0;
+
+                entry->PageFrameNumber = copy / PAGE_SIZE;
+                entry->Present = copy != 0;
+                entry->Write = 1;
+                entry->CopyOnWrite = 0;
+            }
+        }
+
+        for (uint pti = 0; pti < 1024; pti++)
+        {
+            page_t *entry = &clone_table.pages[pti];
+            uint vaddr = (pdi * 1024 + pti) * PAGE_SIZE;
+
+            if (entry->Present)
+            {
+                virtual_map_page(child, vaddr, entry->PageFrameNumber * PAGE_SIZE, true);
+                *virtual_page(child, vaddr) = *entry;
+            }
         }
     }
-    memory_free(&kpdir, (uint)pdir, 1, 0);
 
-    sk_atomic_end();
+    // The parent lost write access to its pages. Once virtual_flush() returns
+    // none of its threads can write to the frames shared with the child.
+    if (shared)
+    {
+        virtual_flush(parent, KERNEL_PAGES * PAGE_SIZE, 1024 * 1024 - KERNEL_PAGES, false);
+    }
+
+    spinlock_release_irqrestore(&vmm_lock);
+
+    return failed ? -1 : 0;
 }
 
+// Only pages which weren't present are mapped, so there is nothing to flush.
 int memory_map(page_directorie_t *pdir, uint addr, uint count, int user)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    if (user && addr / PAGE_SIZE >= KERNEL_PAGES)
+    {
+        virtual_reserve(pdir, addr, count);
+        spinlock_release_irqrestore(&vmm_lock);
+
+        return 0;
+    }
+
+    virtual_ranges_update(pdir, addr, count, false);
 
     for (uint i = 0; i < count; i++)
     {
         uint vaddr = addr + i * PAGE_SIZE;
 
-        if (!virtual_present(pdir, vaddr, 1))
+        if (!page_present(pdir, vaddr))
         {
-            uint paddr = physical_alloc(1);
-            virtual_map(pdir, vaddr, paddr, 1, user);
+            virtual_map_page(pdir, vaddr, physical_alloc(1), user);
         }
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&vmm_lock);
 
     return 0;
 }
 
 int memory_unmap(page_directorie_t *pdir, uint addr, uint count)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    bool unmapped = false;
 
     for (uint i = 0; i < count; i++)
     {
         uint vaddr = addr + i * PAGE_SIZE;
 
-        if (virtual_present(pdir, vaddr, 1))
+        if (virtual_is_large(pdir, vaddr))
+        {
+            physical_free(virtual_unmap_large(pdir, vaddr), LARGE_PAGE_PAGES);
+            i += LARGE_PAGE_PAGES - 1 - PT_INDEX(vaddr);
+            continue;
+        }
+
+        bool present = page_present(pdir, vaddr);
+
+        if (present && virtual_page(pdir, vaddr)->Shared && virtual2physical(pdir, vaddr) != zero_page)
+        {
+            // Frames owned by someone else stay mapped.
+            continue;
+        }
+
+        if (present)
+        {
+            page_t old = virtual_unmap_page(pdir, vaddr);
+
+            if (!old.Shared)
+            {
+                physical_free(old.PageFrameNumber * PAGE_SIZE, 1);
+            }
+
+            unmapped = true;
+        }
+
+        // Reserved pages which were never touched are given back too.
+        virtual_ranges_update(pdir, vaddr, 1, true);
+
+        if (vaddr / PAGE_SIZE >= KERNEL_PAGES)
         {
-            physical_free(virtual2physical(pdir, vaddr), 1);
-            virtual_unmap(pdir, vaddr, 1);
+            virtual_ranges_claim(virtual_demand(pdir), vaddr / PAGE_SIZE, 1);
         }
     }
 
-    sk_atomic_end();
+    if (unmapped)
+    {
+        virtual_flush(pdir, addr, count, false);
+    }
+
+    spinlock_release_irqrestore(&vmm_lock);
+
+    return 0;
+}
+
+int memory_map_readonly(page_directorie_t *pdir, uint addr, uint paddr, uint count)
+{
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    virtual_map(pdir, addr, paddr, count, 1);
+
+    for (uint i = 0; i < count; i++)
+    {
+        page_t *p = virtual_page(pdir, addr + i * PAGE_SIZE);
+        p->Write = 0;
+        p->Shared = 1;
+    }
+
+    spinlock_release_irqrestore(&vmm_lock);
 
     return 0;
 }
 
 int memory_identity_map(page_directorie_t *pdir, uint addr, uint count)
 {
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    spinlock_acquire_irqsave(&pmm_lock);
     physical_set_used(addr, count);
+    spinlock_release_irqrestore(&pmm_lock);
+
     virtual_map(pdir, addr, addr, count, 0);
 
+    spinlock_release_irqrestore(&vmm_lock);
+
     return 0;
 }
 
 int memory_identity_unmap(page_directorie_t *pdir, uint addr, uint count)
 {
-    physical_set_free(addr, count);
+    spinlock_acquire_irqsave(&vmm_lock);
+
+    physical_free(addr, count);
     virtual_unmap(pdir, addr, count);
 
+    spinlock_release_irqrestore(&vmm_lock);
+
     return 0;
 }
 
@@ -493,8 +2034,12 @@ void memory_dump(page_directorie_t *pdir)
         page_directorie_entry_t *pde = &pdir->entries[i];
         if (pde->Present)
         {
-            printf("pdir[%d]={ PFN=%d PRESENT=%d WRITE=%d USER=%d }\n", i, pde->PageFrameNumber, pde->Present, pde->Write, pde->User);
-            page_table_t *ptable = (page_table_t *)(pde->PageFrameNumber * PAGE_SIZE);
+            printf("pdir[%d]={ PFN=%d PRESENT=%d WRITE=%d USER=%d LARGE=%d }\n", i, pde->PageFrameNumber, pde->Present, pde->Write, pde->User, pde->LargePage);
+
+            if (pde->LargePage)
+                continue;
+
+            page_table_t *ptable = virtual_table(pdir, i * 1024 * PAGE_SIZE);
 
             for (size_t i = 0; i < 1024; i++)
             {
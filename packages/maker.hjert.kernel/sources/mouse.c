@@ -3,16 +3,17 @@
 /* See: LICENSE.md                                                            */
 
 #include <string.h>
-#include <skift/atomic.h>
 
 #include "kernel/cpu/irq.h"
 #include "kernel/processor.h"
 #include "kernel/protocol.h"
+#include "kernel/spinlock.h"
 #include "kernel/tasking.h"
 
 #include "kernel/mouse.h"
 
 mouse_state_t oldmouse;
+spinlock_t mouse_lock = SPINLOCK("mouse");
 
 /* --- Private functions ---------------------------------------------------- */
 
@@ -100,7 +101,9 @@ void mouse_handle_packet(ubyte packet0, ubyte packet1, ubyte packet2, ubyte pack
         }
     }
 
+    spinlock_acquire_irqsave(&mouse_lock);
     oldmouse = newmouse;
+    spinlock_release_irqrestore(&mouse_lock);
 }
 
 uchar cycle = 0;
@@ -217,14 +220,14 @@ void mouse_setup()
 // XXX: this is no longer needed...
 void mouse_get_state(mouse_state_t *state)
 {
-    ATOMIC({
-        memcpy(state, &oldmouse, sizeof(mouse_state_t));
-    });
+    spinlock_acquire_irqsave(&mouse_lock);
+    memcpy(state, &oldmouse, sizeof(mouse_state_t));
+    spinlock_release_irqrestore(&mouse_lock);
 }
 
 void mouse_set_state(mouse_state_t *state)
 {
-    ATOMIC({
-        memcpy(&oldmouse, state, sizeof(mouse_state_t));
-    });
+    spinlock_acquire_irqsave(&mouse_lock);
+    memcpy(&oldmouse, state, sizeof(mouse_state_t));
+    spinlock_release_irqrestore(&mouse_lock);
 }
\ No newline at end of file
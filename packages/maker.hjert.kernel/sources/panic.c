@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <skift/atomic.h>
 
+#include "kernel/spinlock.h"
 #include "kernel/tasking.h"
 #include "kernel/system.h"
 
@@ -33,6 +34,7 @@ void __panic(const string file, const string function, const int line, processor
 
     cli();
     sk_atomic_disable();
+    spinlock_disable_all();
 
     va_list va;
     va_start(va, message);
@@ -5,7 +5,6 @@
 /* plugs.c: Plugs functions for using the skift Framework in the kernel.      */
 
 #include <string.h>
-#include <skift/atomic.h>
 #include <skift/logger.h>
 #include <skift/formatter.h>
 #include <skift/__plugs.h>
@@ -14,6 +13,12 @@
 #include "kernel/system.h"
 #include "kernel/memory.h"
 #include "kernel/console.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
+#include "kernel/tasking.h"
+
+spinlock_t logger_lock = SPINLOCK("logger");
+spinlock_t memalloc_lock = SPINLOCK("memalloc");
 
 void __plug_init(void)
 {
@@ -22,13 +27,9 @@ void __plug_init(void)
 
 int __plug_print(const char *buffer)
 {
-    sk_atomic_begin();
-
     console_print(buffer);
     //serial_writeln((char *)buffer);
 
-    sk_atomic_end();
-
     return strlen(buffer);
 }
 
@@ -59,25 +60,25 @@ void __plug_assert_failed(const char *expr, const char *file, const char *functi
 
 int __plug_logger_lock()
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&logger_lock);
     return 0;
 }
 
 int __plug_logger_unlock()
 {
-    sk_atomic_end();
+    spinlock_release_irqrestore(&logger_lock);
     return 0;
 }
 
 int __plug_memalloc_lock()
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&memalloc_lock);
     return 0;
 }
 
 int __plug_memalloc_unlock()
 {
-    sk_atomic_end();
+    spinlock_release_irqrestore(&memalloc_lock);
     return 0;
 }
 
@@ -91,4 +92,19 @@ int __plug_memalloc_free(void *memory, uint size)
 {
     memory_free(memory_kpdir(), (uint)memory, size, 0);
     return 0;
+}
+
+int __plug_processor_id()
+{
+    return cpu_self()->id;
+}
+
+int __plug_futex_wait(int *addr, int expected)
+{
+    return thread_futex_wait(addr, expected);
+}
+
+int __plug_futex_wake(int *addr, int count)
+{
+    return thread_futex_wake(addr, count);
 }
\ No newline at end of file
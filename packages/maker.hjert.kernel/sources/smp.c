@@ -0,0 +1,202 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* smp.c: Bring-up of the application processors.                            */
+
+/*
+ * The processors are listed by the ACPI MADT. Each application processor is
+ * woken up with an INIT-SIPI-SIPI sequence and starts in real mode in the
+ * trampoline, which switches to protected mode, loads the kernel page
+ * directory and jumps to smp_ap_main() on the stack of its idle thread.
+ *
+ * The boot processor keeps driving the PIT and the timer queue, the other
+ * processors are ticked by their local APIC timer at the end of each timeslice.
+ */
+
+#include <string.h>
+#include <skift/logger.h>
+
+#include "kernel/acpi.h"
+#include "kernel/cpu/apic.h"
+#include "kernel/cpu/fpu.h"
+#include "kernel/cpu/gdt.h"
+#include "kernel/cpu/idt.h"
+#include "kernel/cpu/irq.h"
+#include "kernel/cpu/sysenter.h"
+#include "kernel/memory.h"
+#include "kernel/timer.h"
+
+#include "kernel/smp.h"
+
+#define TRAMPOLINE_BASE 0x8000
+#define AP_STARTUP_TIMEOUT 100 // in milliseconds
+
+typedef PACKED(struct)
+{
+    u32 pdir;
+    u32 stack;
+    u32 entry;
+    u32 cr4;
+} trampoline_data_t;
+
+// define in cpu/trampoline.s
+extern u8 smp_trampoline_start[];
+extern u8 smp_trampoline_data[];
+extern u8 smp_trampoline_end[];
+
+cpu_t cpus[MAX_CPU];
+int cpu_count = 1;
+
+cpu_t *cpu_by_apic[256];
+
+/* --- Application processors ----------------------------------------------- */
+
+void smp_ap_main()
+{
+    gdt_load();
+    idt_load();
+    memory_enable();
+    fpu_enable();
+    sysenter_enable();
+    lapic_enable();
+
+    cpu_t *cpu = cpu_self();
+
+    // The local APIC timer is only armed by the sheduler when a timeslice
+    // has to end, an idle processor isn't ticked.
+    cpu->online = true;
+
+    // Shootdowns sent before we were online were missed.
+    __sync_synchronize();
+    paging_invalidate_tlb();
+
+    tasking_cpu_enter(cpu);
+}
+
+bool smp_start(cpu_t *cpu)
+{
+    tasking_cpu_setup(cpu);
+
+    trampoline_data_t *data = (trampoline_data_t *)(TRAMPOLINE_BASE + (smp_trampoline_data - smp_trampoline_start));
+
+    data->pdir = (u32)memory_kpdir();
+    data->stack = (u32)cpu->idle->stack + STACK_SIZE;
+    data->entry = (u32)&smp_ap_main;
+    data->cr4 = CR4();
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_IPI_INIT);
+    timer_busy_wait(10000);
+
+    for (int i = 0; i < 2 && !cpu->online; i++)
+    {
+        lapic_send_ipi(cpu->apic_id, LAPIC_IPI_STARTUP | (TRAMPOLINE_BASE >> 12));
+        timer_busy_wait(200);
+    }
+
+    for (int i = 0; i < AP_STARTUP_TIMEOUT && !cpu->online; i++)
+    {
+        timer_busy_wait(1000);
+    }
+
+    return cpu->online;
+}
+
+/* --- Public functions ----------------------------------------------------- */
+
+void smp_setup()
+{
+    acpi_setup();
+
+    acpi_madt_t *madt = (acpi_madt_t *)acpi_table("APIC");
+
+    if (madt == NULL)
+    {
+        sk_log(LOG_INFO, "No MADT found, running on the boot processor only.");
+        return;
+    }
+
+    lapic_setup(madt->lapic);
+    lapic_enable();
+
+    cpus[0].apic_id = lapic_id();
+    cpu_by_apic[cpus[0].apic_id] = &cpus[0];
+
+    lapic_timer_calibrate();
+
+    // List the processors.
+    for (uint offset = sizeof(acpi_madt_t); offset < madt->header.length;)
+    {
+        acpi_madt_entry_t *entry = (acpi_madt_entry_t *)((uint)madt + offset);
+
+        if (entry->type == MADT_LAPIC)
+        {
+            acpi_madt_lapic_t *lapic = (acpi_madt_lapic_t *)entry;
+
+            if ((lapic->flags & MADT_LAPIC_ENABLED) && lapic->apic_id != cpus[0].apic_id)
+            {
+                if (cpu_count < MAX_CPU)
+                {
+                    cpu_t *cpu = &cpus[cpu_count];
+
+                    cpu->id = cpu_count;
+                    cpu->apic_id = lapic->apic_id;
+                    cpu_by_apic[cpu->apic_id] = cpu;
+
+                    cpu_count++;
+                }
+                else
+                {
+                    sk_log(LOG_WARNING, "Too many processors, ignoring APIC ID=%d.", lapic->apic_id);
+                }
+            }
+        }
+
+        offset += entry->length ? entry->length : sizeof(acpi_madt_entry_t);
+    }
+
+    // Start them one by one since they share the trampoline.
+    memcpy((void *)TRAMPOLINE_BASE, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+
+    int online = 1;
+
+    for (int i = 1; i < cpu_count; i++)
+    {
+        if (smp_start(&cpus[i]))
+        {
+            sk_log(LOG_DEBUG, "Processor %d (APIC ID=%d) is online.", i, cpus[i].apic_id);
+            online++;
+        }
+        else
+        {
+            sk_log(LOG_WARNING, "Processor %d (APIC ID=%d) failed to start!", i, cpus[i].apic_id);
+        }
+    }
+
+    sk_log(LOG_INFO, "%d processors online.", online);
+}
+
+int smp_cpu_count()
+{
+    return cpu_count;
+}
+
+cpu_t *cpu_get(int id)
+{
+    return &cpus[id];
+}
+
+cpu_t *cpu_self()
+{
+    if (lapic_present())
+    {
+        cpu_t *cpu = cpu_by_apic[lapic_id()];
+
+        if (cpu != NULL)
+        {
+            return cpu;
+        }
+    }
+
+    return &cpus[0];
+}
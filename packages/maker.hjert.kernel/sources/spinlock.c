@@ -0,0 +1,260 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* spinlock.c: Recursive spinlocks and preemption control                     */
+
+/*
+ * Each subsystem of the kernel protects its data with its own lock, so the
+ * processors only wait on each other when they actually touch the same data.
+ *
+ * When they need to be nested, locks are taken in this order:
+ *
+ *     messaging -> tasking -> timer -> memalloc -> vmm -> pmm
+ *
+ * The logger and the console locks are always taken last.
+ */
+
+#include <stdio.h>
+
+#include "kernel/memory.h"
+#include "kernel/processor.h"
+#include "kernel/smp.h"
+#include "kernel/tasking.h"
+
+#include "kernel/spinlock.h"
+
+bool spinlock_bypass = false;
+
+#if SPINLOCK_DEBUG
+
+#define SPINLOCK_DEBUG_MAX 64
+
+spinlock_t *spinlocks[SPINLOCK_DEBUG_MAX];
+int spinlocks_count = 0;
+
+void spinlock_debug_register(spinlock_t *lock)
+{
+    int index = __sync_fetch_and_add(&spinlocks_count, 1);
+
+    if (index < SPINLOCK_DEBUG_MAX)
+    {
+        spinlocks[index] = lock;
+    }
+}
+
+#endif
+
+/* --- Private functions ---------------------------------------------------- */
+
+void spinlock_spin(spinlock_t *lock)
+{
+    while (!__sync_bool_compare_and_swap(&lock->locked, 0, 1))
+    {
+#if SPINLOCK_DEBUG
+        lock->contentions++;
+#endif
+
+        // Wait for the lock to look free before trying again, so we don't
+        // keep bouncing its cache line between the processors. Its owner may
+        // be waiting for us to flush our TLB.
+        while (lock->locked)
+        {
+            asm volatile("pause");
+            memory_tlb_poll();
+        }
+    }
+
+    __sync_synchronize();
+}
+
+void spinlock_owned(spinlock_t *lock, int owner)
+{
+    lock->owner = owner;
+    lock->depth = 1;
+
+#if SPINLOCK_DEBUG
+    if (!lock->registered)
+    {
+        lock->registered = true;
+        spinlock_debug_register(lock);
+    }
+
+    lock->acquired = rdtsc();
+#endif
+}
+
+/* --- Public functions ----------------------------------------------------- */
+
+void spinlock_init(spinlock_t *lock, const char *name)
+{
+    *lock = (spinlock_t)SPINLOCK(name);
+}
+
+void spinlock_acquire(spinlock_t *lock)
+{
+    if (spinlock_bypass)
+        return;
+
+    preempt_disable();
+
+    int self = cpu_self()->id;
+
+    if (lock->owner == self)
+    {
+        lock->depth++;
+        return;
+    }
+
+    spinlock_spin(lock);
+    spinlock_owned(lock, self);
+}
+
+void spinlock_release(spinlock_t *lock)
+{
+    if (spinlock_bypass)
+        return;
+
+    lock->depth--;
+
+    if (lock->depth == 0)
+    {
+#if SPINLOCK_DEBUG
+        u64 held = rdtsc() - lock->acquired;
+
+        if (held > lock->longest)
+        {
+            lock->longest = held;
+        }
+
+        if (held > SPINLOCK_DEBUG_THRESHOLD)
+        {
+            lock->overruns++;
+        }
+#endif
+
+        lock->owner = -1;
+
+        __sync_synchronize();
+        lock->locked = 0;
+    }
+
+    preempt_enable();
+}
+
+bool spinlock_try_acquire(spinlock_t *lock)
+{
+    if (spinlock_bypass)
+        return true;
+
+    preempt_disable();
+
+    if (!__sync_bool_compare_and_swap(&lock->locked, 0, 1))
+    {
+        preempt_enable();
+        return false;
+    }
+
+    __sync_synchronize();
+    spinlock_owned(lock, cpu_self()->id);
+
+    return true;
+}
+
+void spinlock_acquire_irqsave(spinlock_t *lock)
+{
+    bool interrupts = interrupts_enabled();
+    cli();
+
+    spinlock_acquire(lock);
+
+    if (lock->depth == 1)
+    {
+        lock->interrupts = interrupts;
+    }
+}
+
+void spinlock_release_irqrestore(spinlock_t *lock)
+{
+    bool restore = lock->depth == 1 && lock->interrupts;
+
+    spinlock_release(lock);
+
+    if (restore)
+    {
+        sti();
+        preempt_check();
+    }
+}
+
+bool spinlock_held(spinlock_t *lock)
+{
+    return lock->locked && lock->owner == cpu_self()->id;
+}
+
+void spinlock_disable_all()
+{
+    spinlock_bypass = true;
+}
+
+void spinlock_dump_all()
+{
+#if SPINLOCK_DEBUG
+    printf("\n\tSpinlocks:");
+
+    for (int i = 0; i < spinlocks_count && i < SPINLOCK_DEBUG_MAX; i++)
+    {
+        spinlock_t *lock = spinlocks[i];
+
+        printf("\n\t%s: longest=%d cycles, overruns=%d, contentions=%d",
+               lock->name, (uint)lock->longest, lock->overruns, lock->contentions);
+    }
+#else
+    printf("\n\tSpinlock statistics are disabled (see SPINLOCK_DEBUG).");
+#endif
+}
+
+/* --- Preemption ----------------------------------------------------------- */
+
+// The counter belong to the processor, so interrupts are disabled while it is
+// looked up, or we could be moved to another processor in between.
+
+void preempt_disable()
+{
+    bool interrupts = interrupts_enabled();
+    cli();
+
+    cpu_self()->preempt++;
+
+    if (interrupts)
+    {
+        sti();
+    }
+}
+
+void preempt_enable()
+{
+    // We can't be moved to another processor until the counter drop to zero.
+    cpu_self()->preempt--;
+
+    preempt_check();
+}
+
+bool preempt_enabled()
+{
+    return cpu_self()->preempt == 0;
+}
+
+void preempt_check()
+{
+    // Interrupts are disabled when called from the sheduler itself.
+    if (interrupts_enabled())
+    {
+        cpu_t *cpu = cpu_self();
+
+        if (cpu->preempt == 0 && cpu->resched)
+        {
+            schedule();
+        }
+    }
+}
@@ -13,6 +13,7 @@
 
 #include <skift/logger.h>
 
+#include "kernel/filesystem.h"
 #include "kernel/tasking.h"
 #include "kernel/serial.h"
 #include "kernel/graphic.h"
@@ -41,6 +42,11 @@ int sys_process_exec(const char *file_name, const char **argv)
     return process_exec(file_name, argv);
 }
 
+int sys_process_clone(thread_entry_t entry)
+{
+    return process_clone(entry);
+}
+
 int sys_process_exit(int code)
 {
     process_exit(code);
@@ -64,9 +70,9 @@ int sys_process_unmap(uint addr, uint count)
     return process_unmap(process_self(), addr, count);
 }
 
-int sys_process_alloc(uint count)
+int sys_process_alloc(uint count, int flags)
 {
-    return process_alloc(count);
+    return process_alloc(count, flags);
 }
 
 int sys_process_free(uint addr, uint count)
@@ -104,6 +110,12 @@ int sys_thread_sleep(int time)
     return 0;
 }
 
+int sys_thread_usleep(uint usec)
+{
+    thread_usleep(usec);
+    return 0;
+}
+
 int sys_thread_wakeup(THREAD t)
 {
     thread_wakeup(t);
@@ -120,6 +132,36 @@ int sys_thread_waitproc(PROCESS p)
     return thread_waitproc(p);
 }
 
+int sys_thread_setpriority(THREAD t, int priority)
+{
+    return thread_setpriority(t, priority);
+}
+
+int sys_thread_getpriority(THREAD t)
+{
+    return thread_getpriority(t);
+}
+
+int sys_thread_setpolicy(THREAD t, int policy, int priority)
+{
+    return thread_setpolicy(t, policy, priority);
+}
+
+int sys_thread_getpolicy(THREAD t)
+{
+    return thread_getpolicy(t);
+}
+
+int sys_thread_futex_wait(int *addr, int expected)
+{
+    return thread_futex_wait(addr, expected);
+}
+
+int sys_thread_futex_wake(int *addr, int count)
+{
+    return thread_futex_wake(addr, count);
+}
+
 /* --- Messaging ------------------------------------------------------------ */
 int sys_messaging_send(PROCESS to, const char *name, void *payload, uint size, uint flags)
 {
@@ -190,10 +232,100 @@ int sys_io_graphic_size(unsigned int *width, unsigned int *height)
     return 0;
 }
 
+/* --- Submission ring ------------------------------------------------------ */
+
+int ring_file_read(const char *path, uint offset, void *buffer, uint size)
+{
+    file_t *file = file_open(NULL, path);
+
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int result = file_read(file, offset, buffer, size);
+    file_close(file);
+
+    return result;
+}
+
+int ring_execute(ring_submission_t *submission)
+{
+    int *p = submission->params;
+
+    switch (submission->op)
+    {
+    case RING_OP_NOP:
+        return 0;
+
+    case RING_OP_PRINT:
+        return sys_io_print((const char *)p[0]);
+
+    case RING_OP_SEND:
+        return sys_messaging_send(p[0], (const char *)p[1], (void *)p[2], p[3], p[4]);
+
+    case RING_OP_BROADCAST:
+        return sys_messaging_broadcast((const char *)p[0], (const char *)p[1], (void *)p[2], p[3], p[4]);
+
+    case RING_OP_BLIT:
+        return sys_io_graphic_blit_region((uint *)p[0], p[1], p[2], p[3], p[4]);
+
+    case RING_OP_FILE_READ:
+        return ring_file_read((const char *)p[0], p[1], (void *)p[2], p[3]);
+
+    default:
+        sk_log(LOG_WARNING, "Unknow ring operation %d from PROCESS=%d.", submission->op, process_self());
+        return -1;
+    }
+}
+
+int sys_ring_setup()
+{
+    return (int)process_ring_setup();
+}
+
+// Run the queued operations in order, until there is no more or the
+// completion ring is full. Return how many were run.
+int sys_ring_enter()
+{
+    ring_t *ring = process_ring_acquire();
+
+    if (ring == NULL)
+    {
+        return -1;
+    }
+
+    int count = 0;
+
+    while (ring->submission_head != ring->submission_tail &&
+           ring->completion_tail - ring->completion_head < RING_COMPLETIONS)
+    {
+        // Copy the submission, so the process can't change it under our feet.
+        __sync_synchronize();
+        ring_submission_t submission = ring->submissions[ring->submission_head % RING_SUBMISSIONS];
+        ring->submission_head++;
+
+        ring_completion_t *completion = &ring->completions[ring->completion_tail % RING_COMPLETIONS];
+        completion->data = submission.data;
+        completion->result = ring_execute(&submission);
+
+        // The completion must be filled before the process can see it.
+        __sync_synchronize();
+        ring->completion_tail++;
+
+        count++;
+    }
+
+    process_ring_release();
+
+    return count;
+}
+
 static int (*syscalls[])() =
 {
     [SYS_PROCESS_SELF] = sys_process_self,
     [SYS_PROCESS_EXEC] = sys_process_exec,
+    [SYS_PROCESS_CLONE] = sys_process_clone,
     [SYS_PROCESS_EXIT] = sys_process_exit,
     [SYS_PROCESS_CANCEL] = sys_process_cancel,
     [SYS_PROCESS_MAP] = sys_process_map,
@@ -206,9 +338,16 @@ static int (*syscalls[])() =
     [SYS_THREAD_EXIT] = sys_thread_exit,
     [SYS_THREAD_CANCEL] = sys_thread_cancel,
     [SYS_THREAD_SLEEP] = sys_thread_sleep,
+    [SYS_THREAD_USLEEP] = sys_thread_usleep,
     [SYS_THREAD_WAKEUP] = sys_thread_wakeup,
     [SYS_THREAD_WAIT] = sys_thread_wait,
     [SYS_THREAD_WAITPROC] = sys_thread_waitproc,
+    [SYS_THREAD_SETPRIORITY] = sys_thread_setpriority,
+    [SYS_THREAD_GETPRIORITY] = sys_thread_getpriority,
+    [SYS_THREAD_SETPOLICY] = sys_thread_setpolicy,
+    [SYS_THREAD_GETPOLICY] = sys_thread_getpolicy,
+    [SYS_THREAD_FUTEX_WAIT] = sys_thread_futex_wait,
+    [SYS_THREAD_FUTEX_WAKE] = sys_thread_futex_wake,
 
     [SYS_MSG_SEND] = sys_messaging_send,
     [SYS_MSG_BROADCAST] = sys_messaging_broadcast,
@@ -227,6 +366,9 @@ static int (*syscalls[])() =
     [SYS_IO_GRAPHIC_BLIT_REGION] = sys_io_graphic_blit_region,
     [SYS_IO_GRAPHIC_SIZE] = sys_io_graphic_size,
 
+    [SYS_RING_SETUP] = sys_ring_setup,
+    [SYS_RING_ENTER] = sys_ring_enter,
+
     [SYS_FILE_CREATE] = sys_not_implemented /* NOT IMPLEMENTED */,
     [SYS_FILE_DELETE] = sys_not_implemented /* NOT IMPLEMENTED */,
     [SYS_FILE_EXISTE] = sys_not_implemented /* NOT IMPLEMENTED */,
@@ -248,18 +390,22 @@ static int (*syscalls[])() =
     [SYS_DIR_LISTDIR] = sys_not_implemented /* NOT IMPLEMENTED */,
 };
 
-void syscall_dispatcher(processor_context_t *context)
+int syscall_fast_dispatcher(syscall_t syscall, int p1, int p2, int p3, int p4, int p5)
 {
-    syscall_t syscall = context->eax;
     if (syscall >= 0 && syscall < SYSCALL_COUNT)
     {
         syscall_handler_t syscall_handler = (syscall_handler_t)syscalls[syscall];
-        context->eax = syscall_handler(context->ebx, context->ecx, context->edx, context->esi, context->edi);
+        return syscall_handler(p1, p2, p3, p4, p5);
     }
     else
     {
         sk_log(LOG_SEVERE, "Unknow syscall ID=%d call by PROCESS=%d.", syscall, process_self());
-        sk_log(LOG_INFO, "EBX=%d, ECX=%d, EDX=%d, ESI=%d, EDI=%d", context->eax, context->ebx, context->ecx, context->edx, context->esi, context->edi);
-        context->eax = 0;
+        sk_log(LOG_INFO, "EBX=%d, ECX=%d, EDX=%d, ESI=%d, EDI=%d", p1, p2, p3, p4, p5);
+        return 0;
     }
+}
+
+void syscall_dispatcher(processor_context_t *context)
+{
+    context->eax = syscall_fast_dispatcher(context->eax, context->ebx, context->ecx, context->edx, context->esi, context->edi);
 }
\ No newline at end of file
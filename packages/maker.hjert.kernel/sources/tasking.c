@@ -8,54 +8,93 @@
  * TODO:
  * - The name of somme function need refactor.
  * - Isolate user space process in ring 3
- * - Add a process/thread garbage colector
  * - Move the sheduler in his own file.
  * - Allow to pass parameters to thread and then return values
- * - Add priority to the round robine sheduler
  * 
  * BUG:
  * - Deadlock when using thread_sleep() when a single thread is running. 
  *   (kinda fixed by adding a dummy hidle thread)
  */
 
+/*
+ * Threads, processes, wait queues and run queues are protected by
+ * `tasking_lock`, channels and inboxes by `messaging_lock` and shared memory
+ * regions by `shm_lock`. When they need to be nested, `messaging_lock` is
+ * taken before `tasking_lock`.
+ */
+
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <skift/elf.h>
-#include <skift/atomic.h>
 #include <skift/logger.h>
 
 #include "kernel/processor.h"
+#include "kernel/cpu/apic.h"
+#include "kernel/cpu/fpu.h"
 #include "kernel/cpu/gdt.h"
 #include "kernel/cpu/irq.h"
+#include "kernel/datapage.h"
 #include "kernel/filesystem.h"
+#include "kernel/handle.h"
 #include "kernel/memory.h"
 #include "kernel/paging.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
 #include "kernel/system.h"
+#include "kernel/timer.h"
 
 #include "kernel/tasking.h"
 
-int PID = 1;
-int TID = 1;
+#define CHANNEL_BUCKET_COUNT 64
+#define FUTEX_BUCKET_COUNT 64
+
+spinlock_t tasking_lock = SPINLOCK("tasking");
+spinlock_t messaging_lock = SPINLOCK("messaging");
+spinlock_t shm_lock = SPINLOCK("shm");
+
 int MID = 1;
 
-uint ticks = 0;
 list_t *threads;
 list_t *processes;
-list_t *channels;
 list_t *shared_memories;
 
+handle_table_t *thread_handles;
+handle_table_t *process_handles;
+
+list_t *channels[CHANNEL_BUCKET_COUNT]; // Channels hashed by name.
+wait_queue_t *futexes[FUTEX_BUCKET_COUNT]; // Threads waiting on an address.
+
+// Exit code of the last reaped processes, for thread_waitproc().
+#define EXIT_STATUS_COUNT 64
+
+struct
+{
+    PROCESS process;
+    int exit_code;
+} exit_statuses[EXIT_STATUS_COUNT];
+
+uint exit_statuses_head = 0;
+
+void free_message(message_t *msg);
+
+void thread_sleep_timeout(void *thread);
+
 thread_t *alloc_thread(thread_entry_t entry, int flags)
 {
     thread_t *thread = MALLOC(thread_t);
     memset(thread, 0, sizeof(thread_t));
 
-    thread->id = TID++;
+    thread->id = handle_alloc(thread_handles, thread);
 
     thread->stack = malloc(STACK_SIZE);
     memset(thread->stack, 0, STACK_SIZE);
 
     thread->entry = entry;
+    thread->priority = THREAD_PRIORITY_NORMAL;
+    thread->policy = THREAD_POLICY_NORMAL;
+    thread->waiters = wait_queue();
+    timer_init(&thread->sleepinfo.timer, thread_sleep_timeout, thread);
 
     thread->esp = ((uint)(thread->stack) + STACK_SIZE);
     thread->esp -= sizeof(processor_context_t);
@@ -95,55 +134,169 @@ thread_t *alloc_thread(thread_entry_t entry, int flags)
     return thread;
 }
 
+// Close all reference to/from this thread, with the tasking lock held.
+void unlink_thread(thread_t *thread)
+{
+    list_remove(threads, thread);
+    list_remove(thread->process->threads, thread);
+    handle_free(thread_handles, thread->id);
+
+    if (thread->process->datapage != NULL)
+    {
+        datapage_remove_thread(thread->process->datapage, thread->id);
+    }
+}
+
 void cleanup_thread(thread_t *thread)
 {
-    // Close all reference to/from this thread.
+    if (thread->messageinfo.message != NULL)
+    {
+        free_message(thread->messageinfo.message);
+    }
+
+    wait_queue_delete(thread->waiters);
+    fpu_release(thread);
 
     // Free the stack.
     free(thread->stack);
-
-    UNUSED(thread);
+    free(thread);
 }
 
 process_t *alloc_process(const char *name, int flags)
 {
     process_t *process = MALLOC(process_t);
 
-    process->id = PID++;
+    process->id = handle_alloc(process_handles, process);
 
     strncpy(process->name, name, PROCNAME_SIZE);
     process->flags = flags;
+    process->state = PROCESS_RUNNING;
+    process->exit_code = 0;
     process->threads = list();
     process->inbox = list();
     process->shared = list();
 
+    process->waiters = wait_queue();
+    process->inbox_waiters = wait_queue();
+
     if (flags & TASK_USER)
     {
         process->pdir = memory_alloc_pdir();
+        process->datapage = datapage_create(process->pdir, process->id);
     }
     else
     {
         process->pdir = memory_kpdir();
+        process->datapage = NULL;
     }
 
+    process->ring = NULL;
+    process->ring_busy = false;
+
     sk_log(LOG_FINE, "Process '%s' with ID=%d allocated.", process->name, process->id);
 
     return process;
 }
 
+// Close all reference to/from this process, with the tasking lock held.
+void unlink_process(process_t *process)
+{
+    process->state = PROCESS_CANCELED;
+
+    // Keep the exit code around for thread_waitproc().
+    exit_statuses[exit_statuses_head].process = process->id;
+    exit_statuses[exit_statuses_head].exit_code = process->exit_code;
+    exit_statuses_head = (exit_statuses_head + 1) % EXIT_STATUS_COUNT;
+
+    list_remove(processes, process);
+    handle_free(process_handles, process->id);
+}
+
 void cleanup_process(process_t *process)
 {
-    // Close all reference to/from this process.
-    
+    spinlock_acquire_irqsave(&messaging_lock);
+
+    for (int i = 0; i < CHANNEL_BUCKET_COUNT; i++)
+    {
+        FOREACH(c, channels[i])
+        {
+            list_remove(((channel_t *)c->value)->subscribers, process);
+        }
+    }
+
     // Cleanup the inbox.
+    message_t *message;
+    while (list_pop(process->inbox, (void **)&message))
+    {
+        free_message(message);
+    }
+
+    spinlock_release_irqrestore(&messaging_lock);
 
     // Free all shared memory region.
+    spinlock_acquire(&shm_lock);
+
+    shared_memory_t *shm;
+    while (list_pop(process->shared, (void **)&shm))
+    {
+        shm->refcount--;
+
+        if (shm->refcount == 0)
+        {
+            shared_memory_delete(shm);
+        }
+    }
+
+    spinlock_release(&shm_lock);
 
     // Free all allocated memory.
+    if (process->pdir != memory_kpdir())
+    {
+        memory_free_pdir(process->pdir);
+    }
 
-    // Mark this process a dead to be free later by the garbage collector.
-    
-    UNUSED(process);
+    if (process->datapage != NULL)
+    {
+        datapage_destroy(process->datapage);
+    }
+
+    sk_log(LOG_DEBUG, "Process '%s' ID=%d cleaned up.", process->name, process->id);
+
+    list_delete(process->threads);
+    list_delete(process->inbox);
+    list_delete(process->shared);
+    wait_queue_delete(process->waiters);
+    wait_queue_delete(process->inbox_waiters);
+
+    free(process);
+}
+
+bool process_exit_status(PROCESS p, int *exit_code)
+{
+    for (int i = 0; i < EXIT_STATUS_COUNT; i++)
+    {
+        if (exit_statuses[i].process == p)
+        {
+            *exit_code = exit_statuses[i].exit_code;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint channel_hash(const char *name)
+{
+    // FNV-1a of the name as stored in channel_t.
+    uint hash = 2166136261u;
+
+    for (int i = 0; i < CHANNAME_SIZE && name[i] != '\0'; i++)
+    {
+        hash ^= (uchar)name[i];
+        hash *= 16777619;
+    }
+
+    return hash;
 }
 
 channel_t *alloc_channel(const char *name)
@@ -152,6 +305,7 @@ channel_t *alloc_channel(const char *name)
 
     channel->subscribers = list();
     strncpy(channel->name, name, CHANNAME_SIZE);
+    channel->hash = channel_hash(name);
 
     return channel;
 }
@@ -187,37 +341,23 @@ void free_message(message_t *msg)
 
 thread_t *thread_get(THREAD thread)
 {
-    FOREACH(i, threads)
-    {
-        thread_t *t = (thread_t *)i->value;
-
-        if (t->id == thread)
-            return t;
-    }
-
-    return NULL;
+    return (thread_t *)handle_get(thread_handles, thread);
 }
 
 process_t *process_get(PROCESS process)
 {
-    FOREACH(i, processes)
-    {
-        process_t *p = (process_t *)i->value;
-
-        if (p->id == process)
-            return p;
-    }
-
-    return NULL;
+    return (process_t *)handle_get(process_handles, process);
 }
 
 channel_t *channel_get(const char *channel)
 {
-    FOREACH(i, channels)
+    uint hash = channel_hash(channel);
+
+    FOREACH(i, channels[hash % CHANNEL_BUCKET_COUNT])
     {
         channel_t *c = (channel_t *)i->value;
 
-        if (strcmp(channel, c->name) == 0)
+        if (c->hash == hash && strncmp(channel, c->name, CHANNAME_SIZE) == 0)
             return c;
     }
 
@@ -229,21 +369,34 @@ channel_t *channel_get(const char *channel)
 PROCESS kernel_process;
 THREAD kernel_thread;
 
-thread_t *running = NULL;
-list_t *waiting;
+// Return the thread calling us. The processor is looked up with the
+// interrupts disabled, otherwise we could be moved to another one in between
+// and return the thread it is running.
+thread_t *thread_running()
+{
+    bool interrupts = interrupts_enabled();
+    cli();
 
-esp_t shedule(esp_t esp, processor_context_t *context);
+    thread_t *thread = cpu_self()->current;
 
-void timer_set_frequency(int hz)
-{
-    u32 divisor = 119318 / hz;
-    outb(0x43, 0x36);
-    outb(0x40, divisor & 0xFF);
-    outb(0x40, (divisor >> 8) & 0xFF);
+    if (interrupts)
+    {
+        sti();
+    }
 
-    sk_log(LOG_DEBUG, "Timer frequency is %dhz.", hz);
+    return thread;
 }
 
+list_t *canceled; // Canceled threads waiting to be cleaned up.
+wait_queue_t *reaper_waiters;
+
+void sheduler_ready(thread_t *thread);
+void sheduler_preempt(thread_t *thread);
+int sheduler_unready(thread_t *thread);
+void sheduler_reap(thread_t *thread);
+bool sheduler_running(thread_t *thread);
+void thread_hold();
+
 // define in cpu/boot.s
 extern u32 __stack_bottom;
 
@@ -251,23 +404,103 @@ void idle()
 {
     while (1)
     {
+        // Nothing else to do, prepare cleared frames for later allocations.
+        while (cpu_self()->ready_count == 0 && memory_clear_frame())
+        {
+        }
+
         hlt();
+
+        // A device interrupt made some threads runnable.
+        if (cpu_self()->ready_count != 0)
+        {
+            schedule();
+        }
+    }
+}
+
+void reaper()
+{
+    while (1)
+    {
+        thread_t *thread = NULL;
+
+        spinlock_acquire_irqsave(&tasking_lock);
+
+        if (!list_pop(canceled, (void **)&thread))
+        {
+            wait_queue_block(reaper_waiters, THREAD_WAIT_THREAD);
+        }
+
+        spinlock_release_irqrestore(&tasking_lock);
+
+        if (thread == NULL)
+        {
+            thread_hold();
+            continue;
+        }
+
+        // The thread is not in any queue anymore and is not running, so once
+        // unlinked nobody else can reach it.
+        spinlock_acquire_irqsave(&tasking_lock);
+
+        sk_log(LOG_DEBUG, "Thread %d canceled!", thread->id);
+        thread->state = THREAD_CANCELED;
+
+        process_t *process = thread->process;
+        unlink_thread(thread);
+
+        bool last = process->threads->count == 0 && process->id != kernel_process;
+
+        if (last)
+        {
+            unlink_process(process);
+        }
+
+        spinlock_release_irqrestore(&tasking_lock);
+
+        cleanup_thread(thread);
+
+        if (last)
+        {
+            cleanup_process(process);
+        }
     }
 }
 
 void tasking_setup()
 {
-    running = NULL;
+    cpu_t *cpu = cpu_self();
+
+    cpu->current = NULL;
+    cpu->online = true;
+
+    canceled = list();
+    reaper_waiters = wait_queue();
 
-    waiting = list();
     threads = list();
     processes = list();
-    channels = list();
     shared_memories = list();
 
+    thread_handles = handle_table();
+    process_handles = handle_table();
+
+    for (int i = 0; i < CHANNEL_BUCKET_COUNT; i++)
+    {
+        channels[i] = list();
+    }
+
+    for (int i = 0; i < FUTEX_BUCKET_COUNT; i++)
+    {
+        futexes[i] = wait_queue();
+    }
+
     kernel_process = process_create("maker.skift.kernel", 0);
     kernel_thread = thread_create(kernel_process, NULL, NULL, 0);
-    thread_create(kernel_process, idle, NULL, 0);
+
+    tasking_cpu_setup(cpu);
+
+    thread_create(kernel_process, reaper, NULL, 0);
 
     // Set the correct stack for the kernel main stack
     thread_t *kthread = thread_get(kernel_thread);
@@ -275,43 +508,160 @@ void tasking_setup()
     kthread->stack = &__stack_bottom;
     kthread->esp = ((uint)(kthread->stack) + STACK_SIZE);
 
-    timer_set_frequency(100);
     irq_register(0, (irq_handler_t)&shedule);
+    irq_register(IRQ_LAPIC_TIMER, (irq_handler_t)&shedule);
+    irq_register(IRQ_SCHEDULE, (irq_handler_t)&shedule);
+    irq_register(IRQ_RESCHEDULE, (irq_handler_t)&shedule);
+}
+
+void tasking_cpu_setup(cpu_t *cpu)
+{
+    for (int i = 0; i < THREAD_PRIORITY_COUNT; i++)
+    {
+        cpu->ready[i] = list();
+        cpu->rt_ready[i] = list();
+    }
+
+    cpu->ready_bitmap = 0;
+    cpu->rt_bitmap = 0;
+    cpu->ready_count = 0;
+    cpu->preempt = 0;
+    cpu->resched = false;
+
+    cpu->rt_period = 0;
+    cpu->rt_since = 0;
+    cpu->rt_runtime = 0;
+    cpu->rt_throttled = false;
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    process_t *process = process_get(kernel_process);
+    thread_t *thread = alloc_thread(idle, 0);
+
+    list_pushback(process->threads, thread);
+    list_pushback(threads, thread);
+    thread->process = process;
+    thread->priority = THREAD_PRIORITY_IDLE;
+    thread->state = THREAD_RUNNING;
+    thread->cpu = cpu;
+
+    cpu->idle = thread;
+
+    spinlock_release_irqrestore(&tasking_lock);
+}
+
+void tasking_cpu_enter(cpu_t *cpu)
+{
+    // We are already on the stack of the idle thread.
+    cpu->current = cpu->idle;
+    cpu->previous = NULL;
+
+    sti();
+    idle();
+}
+
+/* --- Wait queues ---------------------------------------------------------- */
+
+wait_queue_t *wait_queue()
+{
+    wait_queue_t *queue = MALLOC(wait_queue_t);
+
+    queue->threads = list();
+
+    return queue;
+}
+
+void wait_queue_delete(wait_queue_t *queue)
+{
+    list_delete(queue->threads);
+    free(queue);
+}
+
+void wait_queue_block(wait_queue_t *queue, thread_state_t state)
+{
+    thread_t *self = thread_running();
+
+    self->state = state;
+    self->blocker = queue;
+
+    list_pushback(queue->threads, self);
+}
+
+void thread_unblock(thread_t *thread)
+{
+    thread->state = THREAD_RUNNING;
+    thread->blocker = NULL;
+
+    // The running thread is not in any run queue, the sheduler will take care of it.
+    if (!sheduler_running(thread))
+    {
+        sheduler_ready(thread);
+        sheduler_preempt(thread);
+    }
+}
+
+thread_t *wait_queue_wakeup(wait_queue_t *queue)
+{
+    thread_t *thread = NULL;
+
+    if (list_pop(queue->threads, (void **)&thread))
+    {
+        thread_unblock(thread);
+    }
+
+    return thread;
+}
+
+void wait_queue_wakeup_all(wait_queue_t *queue, int outcode)
+{
+    thread_t *thread = NULL;
+
+    while (list_pop(queue->threads, (void **)&thread))
+    {
+        thread->waitinfo.outcode = outcode;
+        thread_unblock(thread);
+    }
 }
 
 /* --- Thread managment ----------------------------------------------------- */
 
-void thread_yield()
+void schedule()
 {
-    asm("int $32");
+    asm volatile("int %0" ::"i"(32 + IRQ_SCHEDULE)
+                 : "memory");
 }
 
-#pragma GCC push_options
-#pragma GCC optimize("O0") // Look like gcc like to break this functions XD
+void thread_yield()
+{
+    schedule();
+}
 
+// Give the cpu away until the thread is woken up.
 void thread_hold()
 {
-    while (running->state != THREAD_RUNNING)
+    thread_t *self = thread_running();
+
+    while (self->state != THREAD_RUNNING)
     {
-        hlt();
+        schedule();
     }
 }
 
-#pragma GCC pop_options
-
 THREAD thread_self()
 {
-    if (running == NULL)
+    thread_t *self = thread_running();
+
+    if (self == NULL)
         return -1;
 
-    return running->id;
+    return self->id;
 }
 
 THREAD thread_create(PROCESS p, thread_entry_t entry, void *arg, int flags)
 {
     UNUSED(arg);
 
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&tasking_lock);
 
     process_t *process = process_get(p);
     thread_t *thread = alloc_thread(entry, process->flags | flags);
@@ -320,168 +670,363 @@ THREAD thread_create(PROCESS p, thread_entry_t entry, void *arg, int flags)
     list_pushback(threads, thread);
     thread->process = process;
 
-    if (running != NULL)
+    if (process->datapage != NULL)
     {
-        list_pushback(waiting, thread);
+        datapage_add_thread(process->datapage, thread->id, (uint)thread->stack);
+    }
+
+    if (flags & THREAD_PINNED)
+    {
+        thread->pinned = true;
+        thread->cpu = cpu_self();
+    }
+
+    if (thread_running() != NULL)
+    {
+        sheduler_ready(thread);
     }
     else
     {
-        running = thread;
+        thread->cpu = cpu_self();
+        thread->cpu->current = thread;
     }
 
     thread->state = THREAD_RUNNING;
 
     sk_log(LOG_FINE, "Thread with ID=%d ENTRY=%x child of process '%s' (ID=%d) is running.", thread->id, entry, process->name, process->id);
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 
     return thread->id;
 }
 
+void thread_sleep_timeout(void *data)
+{
+    thread_t *thread = (thread_t *)data;
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    if (thread->state == THREAD_SLEEP)
+    {
+        thread_unblock(thread);
+        sk_log(LOG_DEBUG, "Thread %d wake up!", thread->id);
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+}
+
 void thread_sleep(int time)
 {
-    ATOMIC({
-        running->state = THREAD_SLEEP;
-        running->sleepinfo.wakeuptick = ticks + time;
-    });
+    thread_usleep((uint)time * 1000);
+}
+
+void thread_usleep(uint usec)
+{
+    thread_t *self = thread_running();
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    self->state = THREAD_SLEEP;
+    timer_schedule(&self->sleepinfo.timer, timer_uptime() + usec);
+
+    spinlock_release_irqrestore(&tasking_lock);
 
     thread_hold();
 }
 
 void thread_wakeup(THREAD t)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&tasking_lock);
 
     thread_t *thread = thread_get(t);
 
     if (thread != NULL && thread->state == THREAD_SLEEP)
     {
-        thread->state = THREAD_RUNNING;
-        thread->sleepinfo.wakeuptick = 0;
+        timer_cancel(&thread->sleepinfo.timer);
+        thread_unblock(thread);
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 }
 
 void *thread_wait(THREAD t)
 {
-    sk_atomic_begin();
+    thread_t *self = thread_running();
+
+    spinlock_acquire_irqsave(&tasking_lock);
 
     thread_t *thread = thread_get(t);
 
-    running->waitinfo.outcode = 0;
+    self->waitinfo.outcode = 0;
 
     if (thread != NULL)
     {
-        running->waitinfo.handle = t;
-        running->state = THREAD_WAIT_THREAD;
+        if (thread->state == THREAD_CANCELING || thread->state == THREAD_CANCELED)
+        {
+            self->waitinfo.outcode = (uint)thread->exit_value;
+        }
+        else
+        {
+            self->waitinfo.handle = t;
+            wait_queue_block(thread->waiters, THREAD_WAIT_THREAD);
+        }
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 
     thread_hold();
 
-    return (void *)running->waitinfo.outcode;
+    return (void *)self->waitinfo.outcode;
 }
 
 int thread_waitproc(PROCESS p)
 {
-    sk_atomic_begin();
+    thread_t *self = thread_running();
+
+    spinlock_acquire_irqsave(&tasking_lock);
 
     process_t *process = process_get(p);
 
-    running->waitinfo.outcode = 0;
+    self->waitinfo.outcode = 0;
 
     if (process != NULL)
     {
-        running->waitinfo.handle = p;
-        running->state = THREAD_WAIT_PROCESS;
+        if (process->state == PROCESS_CANCELING || process->state == PROCESS_CANCELED)
+        {
+            self->waitinfo.outcode = process->exit_code;
+        }
+        else
+        {
+            self->waitinfo.handle = p;
+            wait_queue_block(process->waiters, THREAD_WAIT_PROCESS);
+        }
+    }
+    else
+    {
+        // The process is already gone, look up its exit code.
+        process_exit_status(p, &self->waitinfo.outcode);
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 
     thread_hold();
 
-    return running->waitinfo.outcode;
+    return self->waitinfo.outcode;
 }
 
 int thread_cancel(THREAD t)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&tasking_lock);
 
     thread_t *thread = thread_get(t);
 
-    if (thread != NULL)
+    if (thread != NULL && thread->state != THREAD_CANCELING && thread->state != THREAD_CANCELED)
     {
+        if (thread->blocker != NULL || thread->state == THREAD_SLEEP)
+        {
+            // Pull the thread out of its wait queue or the timer queue so the
+            // sheduler can clean it up.
+            if (thread->blocker != NULL)
+            {
+                list_remove(thread->blocker->threads, thread);
+                thread->blocker = NULL;
+            }
+
+            timer_cancel(&thread->sleepinfo.timer);
+
+            if (!sheduler_running(thread))
+            {
+                sheduler_reap(thread);
+            }
+        }
+
         thread->state = THREAD_CANCELING;
         thread->exit_value = NULL;
         sk_log(LOG_DEBUG, "Thread n°%d got canceled.", t);
+
+        wait_queue_wakeup_all(thread->waiters, 0);
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 
     return thread == NULL; // return 1 if canceling the thread failled!
 }
 
 void thread_exit(void *retval)
 {
-    sk_atomic_begin();
+    thread_t *self = thread_running();
 
-    running->state = THREAD_CANCELING;
-    running->exit_value = retval;
+    spinlock_acquire_irqsave(&tasking_lock);
 
-    sk_log(LOG_DEBUG, "Thread n°%d exited with value 0x%x.", running->id, retval);
+    self->state = THREAD_CANCELING;
+    self->exit_value = retval;
 
-    sk_atomic_end();
+    sk_log(LOG_DEBUG, "Thread n°%d exited with value 0x%x.", self->id, retval);
+
+    wait_queue_wakeup_all(self->waiters, (int)retval);
+
+    spinlock_release_irqrestore(&tasking_lock);
 
     while (1)
-        hlt();
+        schedule();
 }
 
-void thread_dump_all()
+int thread_setpriority(THREAD t, int priority)
 {
-    sk_atomic_begin();
-
-    printf("\n\tThreads:");
-
-    FOREACH(i, threads)
+    if (priority < THREAD_PRIORITY_IDLE || priority > THREAD_PRIORITY_MAX)
     {
-        thread_dump(((thread_t *)i->value)->id);
+        sk_log(LOG_WARNING, "Invalid thread priority %d!", priority);
+        return 1;
     }
 
-    sk_atomic_end();
-}
+    spinlock_acquire_irqsave(&tasking_lock);
 
-void thread_dump(THREAD t)
-{
-    sk_atomic_begin();
+    thread_t *thread = thread_get(t);
+
+    if (thread != NULL)
+    {
+        // Move the thread to the run queue of its new priority.
+        if (!sheduler_running(thread) && sheduler_unready(thread))
+        {
+            thread->priority = priority;
+            sheduler_ready(thread);
+        }
+        else
+        {
+            thread->priority = priority;
+        }
+
+        sk_log(LOG_DEBUG, "Thread n°%d priority set to %d.", t, priority);
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    return thread == NULL; // return 1 if setting the priority failled!
+}
+
+int thread_getpriority(THREAD t)
+{
+    int priority = -1;
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    thread_t *thread = thread_get(t);
+
+    if (thread != NULL)
+    {
+        priority = thread->priority;
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    return priority;
+}
+
+int thread_setpolicy(THREAD t, int policy, int priority)
+{
+    if (policy != THREAD_POLICY_NORMAL && policy != THREAD_POLICY_FIFO && policy != THREAD_POLICY_RR)
+    {
+        sk_log(LOG_WARNING, "Invalid thread policy %d!", policy);
+        return 1;
+    }
+
+    if (priority < THREAD_PRIORITY_IDLE || priority > THREAD_PRIORITY_MAX)
+    {
+        sk_log(LOG_WARNING, "Invalid thread priority %d!", priority);
+        return 1;
+    }
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    thread_t *thread = thread_get(t);
+
+    if (thread != NULL)
+    {
+        // Move the thread to the run queue of its new class.
+        if (!sheduler_running(thread) && sheduler_unready(thread))
+        {
+            thread->policy = policy;
+            thread->priority = priority;
+            sheduler_ready(thread);
+        }
+        else
+        {
+            thread->policy = policy;
+            thread->priority = priority;
+        }
+
+        sk_log(LOG_DEBUG, "Thread n°%d policy set to %d with priority %d.", t, policy, priority);
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    return thread == NULL; // return 1 if setting the policy failled!
+}
+
+int thread_getpolicy(THREAD t)
+{
+    int policy = -1;
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    thread_t *thread = thread_get(t);
+
+    if (thread != NULL)
+    {
+        policy = thread->policy;
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    return policy;
+}
+
+void thread_dump_all()
+{
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    printf("\n\tThreads:");
+
+    FOREACH(i, threads)
+    {
+        thread_dump(((thread_t *)i->value)->id);
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+}
+
+void thread_dump(THREAD t)
+{
+    spinlock_acquire_irqsave(&tasking_lock);
 
     thread_t *thread = thread_get(t);
 
     printf("\n\tThread ID=%d child of process '%s' ID=%d.", t, thread->process->name, thread->process->id);
-    printf("(ESP=0x%x STACK=%x STATE=%x)", thread->esp, thread->stack, thread->state);
+    printf("(ESP=0x%x STACK=%x STATE=%x PRIO=%d POLICY=%d)", thread->esp, thread->stack, thread->state, thread->priority, thread->policy);
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 }
 
 /* --- Process managment ---------------------------------------------------- */
 
 PROCESS process_self()
 {
-    if (running == NULL)
+    thread_t *self = thread_running();
+
+    if (self == NULL)
         return -1;
 
-    return running->process->id;
+    return self->process->id;
 }
 
 PROCESS process_create(const char *name, int flags)
 {
-    process_t *process;
+    spinlock_acquire_irqsave(&tasking_lock);
 
-    ATOMIC({
-        process = alloc_process(name, flags);
-        list_pushback(processes, process);
-    });
+    process_t *process = alloc_process(name, flags);
+    list_pushback(processes, process);
+
+    spinlock_release_irqrestore(&tasking_lock);
 
     sk_log(LOG_FINE,"Process '%s' with ID=%d and PDIR=%x is running.", process->name, process->id, process->pdir);
 
@@ -494,19 +1039,25 @@ void load_elfseg(process_t *process, uint src, uint srcsz, uint dest, uint dests
 
     if (dest >= 0x100000)
     {
-        sk_atomic_begin();
+        // The sheduler would switch back to our own page directory.
+        preempt_disable();
 
         // To avoid pagefault we need to switch page directorie.
-        page_directorie_t *pdir = running->process->pdir;
+        page_directorie_t *pdir = thread_running()->process->pdir;
 
         paging_load_directorie(process->pdir);
-        process_map(process->id, dest, PAGE_ALIGN(destsz) / PAGE_SIZE);
-        memset((void *)dest, 0, destsz);
+
+        // Reserve the whole segment at once, pages are zero-filled when they
+        // are first touched, so only the file data has to be copied.
+        uint base = dest - dest % PAGE_SIZE;
+        uint pages = (dest + destsz - base + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        process_map(process->id, base, pages);
         memcpy((void *)dest, (void *)src, srcsz);
 
         paging_load_directorie(pdir);
 
-        sk_atomic_end();
+        preempt_enable();
     }
     else
     {
@@ -547,6 +1098,42 @@ PROCESS process_exec(const char *path, const char **arg)
     return p;
 }
 
+PROCESS process_clone(thread_entry_t entry)
+{
+    process_t *parent = thread_running()->process;
+
+    if (parent->pdir == memory_kpdir())
+    {
+        sk_log(LOG_WARNING, "CLONE: the kernel process can't be cloned!");
+        return -1;
+    }
+
+    PROCESS p = process_create(parent->name, parent->flags);
+    process_t *child = process_get(p);
+
+    if (memory_clone_pdir(child->pdir, parent->pdir) != 0)
+    {
+        sk_log(LOG_WARNING, "CLONE: out of memory, clone failed!");
+
+        // The child never ran, it can be freed right away.
+        spinlock_acquire_irqsave(&tasking_lock);
+        child->exit_code = -1;
+        unlink_process(child);
+        spinlock_release_irqrestore(&tasking_lock);
+
+        cleanup_process(child);
+
+        return -1;
+    }
+
+    // memory_clone_pdir() waited for every processor to drop the writable
+    // entries of the parent, its other threads can't change the shared frames
+    // behind the back of the child anymore.
+    thread_create(p, entry, NULL, 0);
+
+    return p;
+}
+
 void cancel_childs(process_t *process)
 {
     FOREACH(i, process->threads)
@@ -558,7 +1145,7 @@ void cancel_childs(process_t *process)
 
 void process_cancel(PROCESS p)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&tasking_lock);
 
     if (p != kernel_process)
     {
@@ -568,6 +1155,7 @@ void process_cancel(PROCESS p)
         sk_log(LOG_DEBUG, "Process '%s' ID=%d canceled!", process->name, process->id);
 
         cancel_childs(process);
+        wait_queue_wakeup_all(process->waiters, process->exit_code);
     }
     else
     {
@@ -575,12 +1163,12 @@ void process_cancel(PROCESS p)
         sk_log(LOG_WARNING, "Process '%s' ID=%d tried to commit murder on the kernel!", process->name, process->id);
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 }
 
 void process_exit(int code)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&tasking_lock);
 
     PROCESS p = process_self();
     process_t *process = process_get(p);
@@ -592,17 +1180,18 @@ void process_exit(int code)
         sk_log(LOG_DEBUG, "Process '%s' ID=%d exited with code %d.", process->name, process->id, code);
 
         cancel_childs(process);
+        wait_queue_wakeup_all(process->waiters, process->exit_code);
 
-        sk_atomic_end();
+        spinlock_release_irqrestore(&tasking_lock);
         while (1)
-            hlt();
+            schedule();
     }
     else
     {
         sk_log(LOG_WARNING, "Kernel try to commit suicide!");
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&tasking_lock);
 }
 
 int process_map(PROCESS p, uint addr, uint count)
@@ -615,15 +1204,68 @@ int process_unmap(PROCESS p, uint addr, uint count)
     return memory_unmap(process_get(p)->pdir, addr, count);
 }
 
-uint process_alloc(uint count)
+uint process_alloc(uint count, int flags)
 {
-    uint addr = memory_alloc(running->process->pdir, count, 1);
+    thread_t *self = thread_running();
+
+    if (flags & PROCESS_ALLOC_LARGE)
+    {
+        return memory_alloc_large(self->process->pdir, count, 1);
+    }
+
+    uint addr = memory_alloc(self->process->pdir, count, 1);
     return addr;
 }
 
 void process_free(uint addr, uint count)
 {
-    return memory_free(running->process->pdir, addr, count, 1);
+    return memory_free(thread_running()->process->pdir, addr, count, 1);
+}
+
+/* --- Process ring --------------------------------------------------------- */
+
+ring_t *process_ring_setup()
+{
+    thread_t *self = thread_running();
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    process_t *process = self->process;
+
+    if (process->ring == NULL && process->pdir != memory_kpdir())
+    {
+        uint count = (sizeof(ring_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+        ring_t *ring = (ring_t *)memory_alloc(process->pdir, count, 1);
+
+        if (ring != NULL)
+        {
+            // We are running in the address space of the process.
+            memset(ring, 0, sizeof(ring_t));
+            process->ring = ring;
+        }
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    return process->ring;
+}
+
+ring_t *process_ring_acquire()
+{
+    process_t *process = thread_running()->process;
+
+    if (process->ring == NULL || !__sync_bool_compare_and_swap(&process->ring_busy, false, true))
+    {
+        return NULL;
+    }
+
+    return process->ring;
+}
+
+void process_ring_release()
+{
+    __sync_synchronize();
+    thread_running()->process->ring_busy = false;
 }
 
 /* --- Shared Memory -------------------------------------------------------- */
@@ -670,42 +1312,46 @@ shared_memory_t * shared_memory_get(void* mem)
 
 void* shared_memory_create(uint size)
 {
-    sk_atomic_begin();
+    thread_t *self = thread_running();
+
+    spinlock_acquire(&shm_lock);
 
     shared_memory_t * shm = shared_memory(size);
 
-    sk_log(LOG_DEBUG, "Shared memory region created @%x by process '%s'@%d.", shm->memory, running->process->name, running->id);
+    sk_log(LOG_DEBUG, "Shared memory region created @%x by process '%s'@%d.", shm->memory, self->process->name, self->id);
 
     if (shm != NULL)
     {
         shared_memory_aquire(shm->memory);
     }
 
-    sk_atomic_end();
+    spinlock_release(&shm_lock);
 
     return shm != NULL ? shm->memory : NULL;
 }
 
 void* shared_memory_aquire(void* mem)
 {
-    sk_atomic_begin();
+    thread_t *self = thread_running();
+
+    spinlock_acquire(&shm_lock);
 
     shared_memory_t* shm = shared_memory_get(mem);
 
     if (shm != NULL)
     {
-        sk_log(LOG_DEBUG, "Shared memory region @%x aquire by process '%s'@%d.", shm->memory, running->process->name, running->id);
-        list_pushback(running->process->shared, shm);
+        sk_log(LOG_DEBUG, "Shared memory region @%x aquire by process '%s'@%d.", shm->memory, self->process->name, self->id);
+        list_pushback(self->process->shared, shm);
         shm->refcount++;
 
-        sk_atomic_end();
+        spinlock_release(&shm_lock);
 
         return mem;
     }
     else
     {
-        sk_log(LOG_WARNING, "Process '%s'@%d tried to aquire a shared memory region @%x.", running->process->name, running->id, mem);
-        sk_atomic_end();
+        sk_log(LOG_WARNING, "Process '%s'@%d tried to aquire a shared memory region @%x.", self->process->name, self->id, mem);
+        spinlock_release(&shm_lock);
 
         return NULL;
     }
@@ -713,14 +1359,16 @@ void* shared_memory_aquire(void* mem)
 
 void shared_memory_realease(void* mem)
 {
-    sk_atomic_begin();
+    thread_t *self = thread_running();
+
+    spinlock_acquire(&shm_lock);
 
     shared_memory_t* shm = shared_memory_get(mem);
 
-    if (shm != NULL && list_containe(running->process->shared, shm))
+    if (shm != NULL && list_containe(self->process->shared, shm))
     {
-        sk_log(LOG_DEBUG, "Shared memory region @%x realease by process '%s'@%d.", shm->memory, running->process->name, running->id);
-        list_remove(running->process->shared, shm);
+        sk_log(LOG_DEBUG, "Shared memory region @%x realease by process '%s'@%d.", shm->memory, self->process->name, self->id);
+        list_remove(self->process->shared, shm);
         shm->refcount--;
 
         if (shm->refcount == 0)
@@ -730,23 +1378,31 @@ void shared_memory_realease(void* mem)
     }
     else
     {
-        sk_log(LOG_WARNING, "Process '%s'@%d tried to realease a shared memory region @%x.", running->process->name, running->id, mem);
+        sk_log(LOG_WARNING, "Process '%s'@%d tried to realease a shared memory region @%x.", self->process->name, self->id, mem);
     }
     
-    sk_atomic_end();
+    spinlock_release(&shm_lock);
 }
 
 /* --- Messaging ------------------------------------------------------------ */
 
 uint messaging_id()
 {
-    uint id;
+    return __sync_fetch_and_add(&MID, 1);
+}
 
-    ATOMIC({
-        id = MID++;
-    });
+void messaging_take(thread_t *thread)
+{
+    if (thread->messageinfo.message != NULL)
+    {
+        free_message(thread->messageinfo.message);
+    }
 
-    return id;
+    message_t *message;
+    list_pop(thread->process->inbox, (void **)&message);
+    thread->messageinfo.message = message;
+
+    sk_log(LOG_DEBUG, "Thread %d received message ID=%d from %d to %d.", thread->id, message->id, message->from, message->to);
 }
 
 int messaging_send_internal(PROCESS from, PROCESS to, int id, const char *name, void *payload, uint size, uint flags)
@@ -759,7 +1415,11 @@ int messaging_send_internal(PROCESS from, PROCESS to, int id, const char *name,
 
     sk_log(LOG_DEBUG, "Sending message ID=%d from %d to %d.", id, from, to);
 
+    // The reaper takes the messaging lock before freeing a process, so it
+    // stays around until we are done.
+    spinlock_acquire_irqsave(&tasking_lock);
     process_t *process = process_get(to);
+    spinlock_release_irqrestore(&tasking_lock);
 
     if (process == NULL)
     {
@@ -779,6 +1439,20 @@ int messaging_send_internal(PROCESS from, PROCESS to, int id, const char *name,
 
     list_pushback(process->inbox, (void *)message);
 
+    // Hand the message to a thread of the process waiting for it, before it
+    // get a chance to run on another processor.
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    thread_t *waiter;
+
+    if (list_pop(process->inbox_waiters->threads, (void **)&waiter))
+    {
+        messaging_take(waiter);
+        thread_unblock(waiter);
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
     sk_log(LOG_DEBUG, "Message ID=%d from %d to %d sended!", id, from, to);
 
     return id;
@@ -786,11 +1460,11 @@ int messaging_send_internal(PROCESS from, PROCESS to, int id, const char *name,
 
 int messaging_send(PROCESS to, const char *name, void *payload, uint size, uint flags)
 {
-    int id = 0;
+    spinlock_acquire_irqsave(&messaging_lock);
+
+    int id = messaging_send_internal(process_self(), to, messaging_id(), name, payload, size, flags);
 
-    ATOMIC({
-        id = messaging_send_internal(process_self(), to, messaging_id(), name, payload, size, flags);
-    });
+    spinlock_release_irqrestore(&messaging_lock);
 
     return id;
 }
@@ -799,7 +1473,7 @@ int messaging_broadcast(const char *channel, const char *name, void *payload, ui
 {
     int id = 0;
 
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&messaging_lock);
 
     channel_t *c = channel_get(channel);
 
@@ -813,20 +1487,33 @@ int messaging_broadcast(const char *channel, const char *name, void *payload, ui
         }
     }
 
-    sk_atomic_end();
+    spinlock_release_irqrestore(&messaging_lock);
 
     return id;
 }
 
 int messaging_receive(message_t *msg)
 {
-    ATOMIC({
-        running->state = THREAD_WAIT_MESSAGE;
-    });
+    thread_t *self = thread_running();
 
-    thread_hold(); // Wait for the sheduler to give us a message.
+    spinlock_acquire_irqsave(&messaging_lock);
 
-    message_t *incoming = running->messageinfo.message;
+    if (self->process->inbox->count > 0)
+    {
+        messaging_take(self);
+    }
+    else
+    {
+        spinlock_acquire_irqsave(&tasking_lock);
+        wait_queue_block(self->process->inbox_waiters, THREAD_WAIT_MESSAGE);
+        spinlock_release_irqrestore(&tasking_lock);
+    }
+
+    spinlock_release_irqrestore(&messaging_lock);
+
+    thread_hold(); // Wait for a sender to give us a message.
+
+    message_t *incoming = self->messageinfo.message;
 
     if (incoming != NULL)
     {
@@ -839,7 +1526,7 @@ int messaging_receive(message_t *msg)
 
 int messaging_payload(void *buffer, uint size)
 {
-    message_t *incoming = running->messageinfo.message;
+    message_t *incoming = thread_running()->messageinfo.message;
 
     if (incoming != NULL && incoming->size > 0 && incoming->payload != NULL)
     {
@@ -852,149 +1539,587 @@ int messaging_payload(void *buffer, uint size)
 
 int messaging_subscribe(const char *channel)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&messaging_lock);
     {
         channel_t *c = channel_get(channel);
 
         if (c == NULL)
         {
             c = alloc_channel(channel);
-            list_pushback(channels, c);
+            list_pushback(channels[c->hash % CHANNEL_BUCKET_COUNT], c);
         }
 
-        list_pushback(c->subscribers, running->process);
+        list_pushback(c->subscribers, thread_running()->process);
     }
-    sk_atomic_end();
+    spinlock_release_irqrestore(&messaging_lock);
 
     return 0;
 }
 
 int messaging_unsubscribe(const char *channel)
 {
-    sk_atomic_begin();
+    spinlock_acquire_irqsave(&messaging_lock);
     {
         channel_t *c = channel_get(channel);
 
         if (c != NULL)
         {
-            list_remove(c->subscribers, running->process);
+            list_remove(c->subscribers, thread_running()->process);
         }
     }
-    sk_atomic_end();
+    spinlock_release_irqrestore(&messaging_lock);
 
     return 0;
 }
 
-/* --- Sheduler ------------------------------------------------------------- */
+/* --- Futex ---------------------------------------------------------------- */
 
-thread_t *get_next_task()
+// Threads waiting on an address are kept in a wait queue selected by hashing
+// the address and the process, so waking an address only look at a handful
+// of threads.
+
+wait_queue_t *futex_bucket(process_t *process, int *addr)
 {
-    thread_t *thread = NULL;
+    uint hash = ((uint)addr >> 2) ^ ((uint)process >> 4);
+
+    return futexes[hash % FUTEX_BUCKET_COUNT];
+}
+
+int thread_futex_wait(int *addr, int expected)
+{
+    thread_t *self = thread_running();
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    // The value changed since the caller looked at it, the wakeup already happened.
+    if (*addr != expected)
+    {
+        spinlock_release_irqrestore(&tasking_lock);
+        return 1;
+    }
+
+    self->waitinfo.handle = (int)addr;
+    self->waitinfo.outcode = 0;
+    wait_queue_block(futex_bucket(self->process, addr), THREAD_WAIT_FUTEX);
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    thread_hold();
+
+    return 0;
+}
+
+int thread_futex_wake(int *addr, int count)
+{
+    thread_t *self = thread_running();
+
+    int woken = 0;
 
-    do
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    wait_queue_t *queue = futex_bucket(self->process, addr);
+    list_item_t *i = queue->threads->head;
+
+    while (i != NULL && woken < count)
     {
-        list_pop(waiting, (void *)&thread);
+        thread_t *thread = (thread_t *)i->value;
+        i = i->next;
 
-        switch (thread->state)
+        if (thread->process == self->process && thread->waitinfo.handle == (int)addr)
         {
-        case THREAD_CANCELING:
+            list_remove(queue->threads, thread);
+            thread_unblock(thread);
+            woken++;
+        }
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    return woken;
+}
+
+/* --- Sheduler ------------------------------------------------------------- */
+
+// Each processor keeps one round robin queue per priority level and per class
+// (normal or real-time), the bit N of its ready_bitmap (or rt_bitmap) is set
+// when the queue of the priority N is not empty. Real-time threads always run
+// before normal ones.
+// Threads waiting on a process, a thread or a message are owned by a wait
+// queue, sleeping threads by their timer, and they don't show up here until
+// they are woken up.
+//
+// Threads stay on the processor they last ran on. New threads go to the least
+// loaded processor, and a processor running out of work steals the highest
+// priority thread of the busiest one.
+
+bool thread_is_realtime(thread_t *thread)
+{
+    return thread->policy != THREAD_POLICY_NORMAL;
+}
+
+// Real-time threads rank above all the normal ones.
+int sheduler_rank(thread_t *thread)
+{
+    return thread->priority + (thread_is_realtime(thread) ? THREAD_PRIORITY_COUNT : 0);
+}
+
+list_t **sheduler_queues(cpu_t *cpu, thread_t *thread, uint **bitmap)
+{
+    if (thread_is_realtime(thread))
+    {
+        *bitmap = &cpu->rt_bitmap;
+        return cpu->rt_ready;
+    }
+    else
+    {
+        *bitmap = &cpu->ready_bitmap;
+        return cpu->ready;
+    }
+}
+
+cpu_t *sheduler_least_loaded()
+{
+    cpu_t *best = cpu_get(0);
+
+    for (int i = 1; i < smp_cpu_count(); i++)
+    {
+        cpu_t *cpu = cpu_get(i);
+
+        if (cpu->online && cpu->ready_count < best->ready_count)
         {
-            sk_log(LOG_DEBUG, "Thread %d canceled!", thread->id);
-            thread->state = THREAD_CANCELED;
-            // TODO: cleanup the thread.
-            // TODO: cleanup the process if no thread is still running.
+            best = cpu;
+        }
+    }
 
-            cleanup_thread(thread);
-            thread = NULL;
-            break;
+    return best;
+}
+
+void sheduler_enqueue(thread_t *thread, bool head)
+{
+    if (thread->cpu == NULL)
+    {
+        thread->cpu = sheduler_least_loaded();
+    }
+
+    cpu_t *cpu = thread->cpu;
+
+    uint *bitmap;
+    list_t **queues = sheduler_queues(cpu, thread, &bitmap);
+
+    if (head)
+    {
+        list_push(queues[thread->priority], thread);
+    }
+    else
+    {
+        list_pushback(queues[thread->priority], thread);
+    }
+
+    *bitmap |= (1 << thread->priority);
+    cpu->ready_count++;
+}
+
+void sheduler_ready(thread_t *thread)
+{
+    sheduler_enqueue(thread, false);
+}
+
+// Woken up threads preempt the running one right away when they are more
+// important, otherwise they wait for the end of its timeslice.
+bool sheduler_wakeup_preempt = true;
+
+void sheduler_set_wakeup_preempt(bool enabled)
+{
+    sheduler_wakeup_preempt = enabled;
+    sk_log(LOG_DEBUG, "Wakeup preemption %s.", enabled ? "enabled" : "disabled");
+}
+
+// The application processors have no tick, their local APIC timer is armed
+// one-shot to end the timeslice of the current thread.
+void sheduler_timeslice(cpu_t *cpu, bool preempt)
+{
+    if (preempt)
+    {
+        lapic_timer_oneshot(32 + IRQ_LAPIC_TIMER, TIMER_QUANTUM);
+    }
+    else if (cpu->timeslice)
+    {
+        lapic_timer_stop();
+    }
+
+    cpu->timeslice = preempt;
+}
+
+void sheduler_preempt(thread_t *thread)
+{
+    cpu_t *cpu = thread->cpu;
+
+    if (cpu->current == NULL)
+    {
+        return;
+    }
+
+    if (sheduler_wakeup_preempt && sheduler_rank(thread) > sheduler_rank(cpu->current))
+    {
+        cpu->resched = true;
+
+        // The current processor switch when leaving its critical section or
+        // its interrupt handler, the other one need to be told.
+        if (cpu != cpu_self())
+        {
+            lapic_send_ipi(cpu->apic_id, LAPIC_IPI_FIXED | (32 + IRQ_RESCHEDULE));
         }
-        case THREAD_SLEEP:
+    }
+    else if (sheduler_rank(thread) >= sheduler_rank(cpu->current))
+    {
+        // The thread is picked up at the end of the timeslice, start one if
+        // the current thread was running alone.
+        if (cpu == cpu_get(0))
         {
-            // Wakeup the thread
-            if (thread->sleepinfo.wakeuptick <= ticks)
-            {
-                thread->state = THREAD_RUNNING;
-                sk_log(LOG_DEBUG, "Thread %d wake up!", thread->id);
-            }
-            break;
+            timer_request_preempt();
         }
-        case THREAD_WAIT_PROCESS:
+        else if (!cpu->timeslice)
         {
-            process_t *wproc = process_get(thread->waitinfo.handle);
-
-            if (wproc->state == PROCESS_CANCELED || wproc->state == PROCESS_CANCELING)
+            if (cpu == cpu_self())
             {
-                thread->state = THREAD_RUNNING;
-                thread->waitinfo.outcode = wproc->exit_code;
-                sk_log(LOG_DEBUG, "Thread %d finish waiting process %d.", thread->id, wproc->id);
+                sheduler_timeslice(cpu, true);
             }
-            break;
+            else
+            {
+                lapic_send_ipi(cpu->apic_id, LAPIC_IPI_FIXED | (32 + IRQ_RESCHEDULE));
+            }
+        }
+    }
+}
+
+int sheduler_unready(thread_t *thread)
+{
+    cpu_t *cpu = thread->cpu;
+
+    if (cpu == NULL)
+    {
+        return 0;
+    }
+
+    uint *bitmap;
+    list_t **queues = sheduler_queues(cpu, thread, &bitmap);
+
+    if (list_remove(queues[thread->priority], thread))
+    {
+        if (queues[thread->priority]->count == 0)
+        {
+            *bitmap &= ~(1 << thread->priority);
         }
-        case THREAD_WAIT_THREAD:
+
+        cpu->ready_count--;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+bool sheduler_running(thread_t *thread)
+{
+    return thread->cpu != NULL && thread->cpu->current == thread;
+}
+
+thread_t *sheduler_steal_from(cpu_t *victim, list_t **queues)
+{
+    for (int priority = THREAD_PRIORITY_MAX; priority >= 0; priority--)
+    {
+        FOREACH(i, queues[priority])
         {
-            thread_t *wthread = thread_get(thread->waitinfo.handle);
+            thread_t *thread = (thread_t *)i->value;
 
-            if (wthread->state == THREAD_CANCELED || wthread->state == THREAD_CANCELING)
+            // The victim may still be on the stack of the thread it just
+            // switched out, and only the victim can save the FPU state it
+            // holds.
+            if (thread != victim->previous && thread != victim->fpu_owner && !thread->pinned)
             {
-                thread->state = THREAD_RUNNING;
-                thread->waitinfo.outcode = (uint)wthread->exit_value;
-                sk_log(LOG_DEBUG, "Thread %d finish waiting thread %d.", thread->id, wthread->id);
+                sheduler_unready(thread);
+                return thread;
             }
-            
-            break;
         }
-        case THREAD_WAIT_MESSAGE:
+    }
+
+    return NULL;
+}
+
+thread_t *sheduler_steal(cpu_t *self)
+{
+    cpu_t *victim = NULL;
+
+    for (int i = 0; i < smp_cpu_count(); i++)
+    {
+        cpu_t *cpu = cpu_get(i);
+
+        if (cpu != self && cpu->online && cpu->ready_count > 0 &&
+            (victim == NULL || cpu->ready_count > victim->ready_count))
         {
-            if (thread->process->inbox->count > 0)
-            {
-                thread->state = THREAD_RUNNING;
+            victim = cpu;
+        }
+    }
 
-                if (thread->messageinfo.message != NULL)
-                {
-                    free_message(thread->messageinfo.message);
-                }
+    if (victim == NULL)
+    {
+        return NULL;
+    }
 
-                message_t *message;
-                list_pop(thread->process->inbox, (void **)&message);
-                thread->messageinfo.message = message;
-                sk_log(LOG_DEBUG, "Thread %d received message ID=%d from %d to %d.", thread->id, message->id, message->from, message->to);
-            }
-            break;
+    thread_t *thread = NULL;
+
+    if (!self->rt_throttled)
+    {
+        thread = sheduler_steal_from(victim, victim->rt_ready);
+    }
+
+    if (thread == NULL)
+    {
+        thread = sheduler_steal_from(victim, victim->ready);
+    }
+
+    return thread;
+}
+
+thread_t *sheduler_pop(cpu_t *cpu, list_t **queues, uint *bitmap)
+{
+    thread_t *thread = NULL;
+
+    while (thread == NULL && *bitmap != 0)
+    {
+        int priority = 31 - __builtin_clz(*bitmap);
+
+        list_pop(queues[priority], (void **)&thread);
+        cpu->ready_count--;
+
+        if (queues[priority]->count == 0)
+        {
+            *bitmap &= ~(1 << priority);
         }
-        default:
-            break;
+
+        if (thread->state != THREAD_RUNNING)
+        {
+            // The thread got canceled while waiting for the cpu.
+            sheduler_reap(thread);
+            thread = NULL;
         }
+    }
+
+    return thread;
+}
+
+thread_t *sheduler_pick(cpu_t *cpu)
+{
+    thread_t *thread = NULL;
+
+    if (!cpu->rt_throttled)
+    {
+        thread = sheduler_pop(cpu, cpu->rt_ready, &cpu->rt_bitmap);
+    }
+
+    if (thread == NULL)
+    {
+        thread = sheduler_pop(cpu, cpu->ready, &cpu->ready_bitmap);
+    }
 
-        if (thread != NULL && thread->state != THREAD_RUNNING)
+    while (thread == NULL && (thread = sheduler_steal(cpu)) != NULL)
+    {
+        if (thread->state != THREAD_RUNNING)
         {
-            // The thread is not a running thread, pushing it back...
-            list_pushback(waiting, thread);
+            sheduler_reap(thread);
+            thread = NULL;
         }
+    }
 
-    } while (thread == NULL || thread->state != THREAD_RUNNING);
+    if (thread == NULL)
+    {
+        thread = cpu->idle;
+    }
+
+    thread->cpu = cpu;
 
     return thread;
 }
 
+void sheduler_reap(thread_t *thread)
+{
+    // Threads are freed by the reaper thread and never from the sheduler
+    // since we may still be running on their stack, the processor switching
+    // them out hand them over once it left it.
+    for (int i = 0; i < smp_cpu_count(); i++)
+    {
+        cpu_t *cpu = cpu_get(i);
+
+        if (cpu->previous == thread)
+        {
+            cpu->dead = thread;
+            return;
+        }
+    }
+
+    list_pushback(canceled, thread);
+    wait_queue_wakeup(reaper_waiters);
+}
+
+void sheduler_switched()
+{
+    cpu_t *cpu = cpu_self();
+
+    // Only this processor set its previous thread, with interrupts disabled.
+    if (cpu->previous == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire_irqsave(&tasking_lock);
+
+    cpu->previous = NULL;
+
+    if (cpu->dead != NULL)
+    {
+        sheduler_reap(cpu->dead);
+        cpu->dead = NULL;
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+}
+
+// Charge the time used by the real-time thread switched out to its processor,
+// and throttle the real-time threads once they used their share of the period.
+void sheduler_rt_account(cpu_t *cpu, thread_t *previous, u64 now)
+{
+    if (thread_is_realtime(previous))
+    {
+        cpu->rt_runtime += (uint)(now - cpu->rt_since);
+    }
+
+    if (now - cpu->rt_period >= SHEDULER_RT_PERIOD)
+    {
+        cpu->rt_period = now;
+        cpu->rt_runtime = 0;
+        cpu->rt_throttled = false;
+    }
+    else if (cpu->rt_runtime >= SHEDULER_RT_RUNTIME && !cpu->rt_throttled)
+    {
+        cpu->rt_throttled = true;
+        sk_log(LOG_WARNING, "Real-time threads throttled on processor %d.", cpu->id);
+    }
+}
+
+// Other threads are waiting for the processor, or the time used by the
+// real-time threads must be checked regularly.
+bool sheduler_need_timeslice(cpu_t *cpu)
+{
+    thread_t *current = cpu->current;
+
+    if (thread_is_realtime(current))
+    {
+        return true;
+    }
+
+    return cpu->rt_bitmap != 0 || (cpu->ready_bitmap >> current->priority) != 0;
+}
+
+// Kernel threads and threads of the same process share their page directory,
+// reloading CR3 between them would only throw away their TLB entries.
+void sheduler_switch_pdir(page_directorie_t *pdir)
+{
+#if SHEDULER_LAZY_CR3
+    if ((reg32_t)pdir != CR3())
+    {
+        paging_load_directorie(pdir);
+    }
+#else
+    paging_load_directorie(pdir);
+    paging_invalidate_tlb();
+#endif
+}
+
 esp_t shedule(esp_t esp, processor_context_t *context)
 {
-    UNUSED(context);
+    cpu_t *cpu = cpu_self();
+    bool boot = cpu == cpu_get(0);
 
-    ticks++;
+    // Wakeup sleeping threads, this must happen before the running thread is
+    // put back in a run queue since it may be one of them.
+    if (boot && context->int_no == 0)
+    {
+        timer_tick();
+    }
+
+    // The running thread is inside a critical section, come back soon.
+    if (cpu->preempt > 0)
+    {
+        if (boot)
+        {
+            timer_reschedule(true);
+        }
+        else
+        {
+            sheduler_timeslice(cpu, true);
+        }
 
-    if (waiting->count == 0)
         return esp;
+    }
+
+    spinlock_acquire_irqsave(&tasking_lock);
 
     // Save the old context
-    running->esp = esp;
-    list_pushback(waiting, running);
+    thread_t *previous = cpu->current;
+    previous->esp = esp;
+
+    // Only read the clock when real-time threads are involved.
+    bool realtime = thread_is_realtime(previous) || cpu->rt_bitmap != 0 || cpu->rt_throttled;
+    u64 now = realtime ? timer_uptime() : 0;
+
+    if (realtime)
+    {
+        sheduler_rt_account(cpu, previous, now);
+    }
+
+    cpu->previous = previous;
+
+    if (previous == cpu->idle)
+    {
+        // The idle thread is never queued.
+    }
+    else if (previous->state == THREAD_RUNNING)
+    {
+        // A FIFO thread keeps its place unless it gave up the cpu itself.
+        bool voluntary = context->int_no == IRQ_SCHEDULE;
+        sheduler_enqueue(previous, previous->policy == THREAD_POLICY_FIFO && !voluntary);
+    }
+    else if (previous->state == THREAD_CANCELING)
+    {
+        sheduler_reap(previous);
+    }
 
     // Load the new context
-    running = get_next_task();
+    cpu->current = sheduler_pick(cpu);
+    cpu->resched = false;
+
+    if (thread_is_realtime(cpu->current))
+    {
+        // The thread may have been stolen from another processor.
+        cpu->rt_since = realtime ? now : timer_uptime();
+    }
+
+    // Only ask for a timeslice when other threads can take the cpu.
+    if (boot)
+    {
+        timer_reschedule(sheduler_need_timeslice(cpu));
+    }
+    else
+    {
+        sheduler_timeslice(cpu, sheduler_need_timeslice(cpu));
+    }
+
+    spinlock_release_irqrestore(&tasking_lock);
+
+    fpu_switch(cpu, cpu->current);
 
     // TODO: set_kernel_stack(...);
-    paging_load_directorie(running->process->pdir);
-    paging_invalidate_tlb();
+    sheduler_switch_pdir(cpu->current->process->pdir);
 
-    return running->esp;
+    return cpu->current->esp;
 }
@@ -0,0 +1,404 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+/* timer.c: PIT driver, monotonic clock and timer queue                      */
+
+/*
+ * Armed timers are kept in a binary min-heap ordered by deadline, so each
+ * interrupt only looks at the root and pops the timers that actually expired.
+ *
+ * The PIT is always used in one-shot mode (mode 0) and reprogrammed after
+ * each interrupt. In dynamic mode it is programmed for the next deadline, or
+ * the end of the timeslice when other threads are waiting for the cpu, so no
+ * interrupt happens while the system is idle. The clock is advanced from the
+ * number of counts actually elapsed, which keeps `ticks` correct whatever the
+ * interrupt rate is.
+ *
+ * The clock and the timer heap are protected by `timer_lock`. Expired timers
+ * are popped with the lock held, but their callbacks run after it has been
+ * released, so they are free to arm timers again.
+ */
+
+#include <stdlib.h>
+#include <skift/logger.h>
+
+#include "kernel/datapage.h"
+#include "kernel/processor.h"
+#include "kernel/spinlock.h"
+
+#include "kernel/timer.h"
+
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_GATE 0x61 // Gate of the channel 2, shared with the pc speaker.
+#define PIT_COUNTS_PER_MS 1193 // The PIT run at 1193182hz.
+
+#define PIT_STATUS_OUTPUT 0x80
+#define PIT_STATUS_NULL_COUNT 0x40
+
+uint ticks = 0;
+
+bool timer_dynamic = true;
+uint timer_quantum = TIMER_QUANTUM;
+
+u64 timer_base = 0;     // Uptime in microseconds when the PIT was last programmed.
+uint timer_period = 0;  // Number of counts the PIT was programmed with.
+uint timer_subtick = 0; // Microseconds not accounted in `ticks` yet.
+u64 timer_expiry = 0;   // Uptime in microseconds of the next interrupt.
+bool timer_preempt = false;
+
+u64 timer_last_uptime = 0;
+
+timer_t **timers = NULL;
+int timers_count = 0;
+int timers_capacity = 0;
+
+spinlock_t timer_lock = SPINLOCK("timer");
+
+/* --- PIT ------------------------------------------------------------------ */
+
+uint counts_to_us(uint counts)
+{
+    return counts * 1000 / PIT_COUNTS_PER_MS;
+}
+
+uint us_to_counts(uint us)
+{
+    return us * PIT_COUNTS_PER_MS / 1000;
+}
+
+void pit_oneshot(uint counts)
+{
+    // Channel 0, lobyte/hibyte, mode 0: interrupt on terminal count.
+    outb(PIT_COMMAND, 0x30);
+    outb(PIT_CHANNEL0, counts & 0xFF);
+    outb(PIT_CHANNEL0, (counts >> 8) & 0xFF);
+}
+
+// Return the number of counts elapsed since the PIT was programmed.
+uint pit_elapsed()
+{
+    // Read-back the status and the count of the channel 0.
+    outb(PIT_COMMAND, 0xC2);
+
+    u8 status = inb(PIT_CHANNEL0);
+    uint count = inb(PIT_CHANNEL0);
+    count |= inb(PIT_CHANNEL0) << 8;
+
+    if (status & PIT_STATUS_NULL_COUNT)
+    {
+        // The new count is not loaded yet.
+        return 0;
+    }
+
+    if (status & PIT_STATUS_OUTPUT)
+    {
+        // The terminal count was reached and the counter wrapped around.
+        return timer_period + ((0x10000 - count) & 0xFFFF);
+    }
+
+    return count < timer_period ? timer_period - count : 0;
+}
+
+// Wait using the channel 2, which leave the channel 0 and the clock alone.
+void pit_wait(uint counts)
+{
+    u8 gate = inb(PIT_GATE) & ~0x03;
+
+    // Channel 2, lobyte/hibyte, mode 0 with the speaker off.
+    outb(PIT_GATE, gate);
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CHANNEL2, counts & 0xFF);
+    outb(PIT_CHANNEL2, (counts >> 8) & 0xFF);
+    outb(PIT_GATE, gate | 0x01);
+
+    while (!(inb(PIT_GATE) & 0x20))
+        ;
+
+    outb(PIT_GATE, gate);
+}
+
+void timer_program(uint usec)
+{
+    uint elapsed = counts_to_us(pit_elapsed());
+
+    timer_base += elapsed;
+
+    timer_subtick += elapsed;
+    ticks += timer_subtick / TIMER_TICK_US;
+    timer_subtick %= TIMER_TICK_US;
+
+    datapage_update(ticks, timer_base);
+
+    timer_period = us_to_counts(usec);
+    timer_expiry = timer_base + usec;
+
+    pit_oneshot(timer_period);
+}
+
+void timer_setup()
+{
+    timers_capacity = 16;
+    timers_count = 0;
+    timers = malloc(sizeof(timer_t *) * timers_capacity);
+
+    timer_period = us_to_counts(TIMER_TICK_US);
+    timer_expiry = TIMER_TICK_US;
+    pit_oneshot(timer_period);
+
+    sk_log(LOG_DEBUG, "Timer is running (dynamic=%d, quantum=%dus).", timer_dynamic, timer_quantum);
+}
+
+/* --- Clock ---------------------------------------------------------------- */
+
+u64 timer_uptime()
+{
+    spinlock_acquire_irqsave(&timer_lock);
+
+    u64 uptime = timer_base + counts_to_us(pit_elapsed());
+
+    // Rounding must not make the clock go backward.
+    if (uptime < timer_last_uptime)
+    {
+        uptime = timer_last_uptime;
+    }
+
+    timer_last_uptime = uptime;
+
+    spinlock_release_irqrestore(&timer_lock);
+
+    return uptime;
+}
+
+/* --- Timer heap ----------------------------------------------------------- */
+
+void timers_swap(int a, int b)
+{
+    timer_t *tmp = timers[a];
+
+    timers[a] = timers[b];
+    timers[a]->index = a;
+
+    timers[b] = tmp;
+    timers[b]->index = b;
+}
+
+void timers_sift_up(int index)
+{
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+
+        if (timers[parent]->deadline <= timers[index]->deadline)
+        {
+            break;
+        }
+
+        timers_swap(parent, index);
+        index = parent;
+    }
+}
+
+void timers_sift_down(int index)
+{
+    while (1)
+    {
+        int left = index * 2 + 1;
+        int right = left + 1;
+        int smallest = index;
+
+        if (left < timers_count && timers[left]->deadline < timers[smallest]->deadline)
+        {
+            smallest = left;
+        }
+
+        if (right < timers_count && timers[right]->deadline < timers[smallest]->deadline)
+        {
+            smallest = right;
+        }
+
+        if (smallest == index)
+        {
+            break;
+        }
+
+        timers_swap(smallest, index);
+        index = smallest;
+    }
+}
+
+void timers_remove(int index)
+{
+    timers_count--;
+    timers[index]->index = -1;
+
+    if (index != timers_count)
+    {
+        timers[index] = timers[timers_count];
+        timers[index]->index = index;
+
+        timers_sift_up(index);
+        timers_sift_down(index);
+    }
+}
+
+/* --- Public functions ----------------------------------------------------- */
+
+void timer_init(timer_t *timer, timer_callback_t callback, void *data)
+{
+    timer->deadline = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->index = -1;
+}
+
+void timer_schedule(timer_t *timer, u64 deadline)
+{
+    spinlock_acquire_irqsave(&timer_lock);
+
+    if (timer->index >= 0)
+    {
+        timers_remove(timer->index);
+    }
+
+    if (timers_count == timers_capacity)
+    {
+        timers_capacity *= 2;
+        timers = realloc(timers, sizeof(timer_t *) * timers_capacity);
+    }
+
+    timer->deadline = deadline;
+    timer->index = timers_count;
+    timers[timers_count++] = timer;
+
+    timers_sift_up(timer->index);
+
+    // The timer expire before the next interrupt, bring it forward.
+    if (timer_dynamic && timer->index == 0 && deadline < timer_expiry)
+    {
+        timer_reschedule(timer_preempt);
+    }
+
+    spinlock_release_irqrestore(&timer_lock);
+}
+
+void timer_cancel(timer_t *timer)
+{
+    spinlock_acquire_irqsave(&timer_lock);
+
+    if (timer->index >= 0)
+    {
+        timers_remove(timer->index);
+    }
+
+    spinlock_release_irqrestore(&timer_lock);
+}
+
+bool timer_armed(timer_t *timer)
+{
+    return timer->index >= 0;
+}
+
+void timer_busy_wait(uint usec)
+{
+    while (usec > 0)
+    {
+        uint delay = usec < TIMER_MAX_DELAY ? usec : TIMER_MAX_DELAY;
+
+        pit_wait(us_to_counts(delay));
+        usec -= delay;
+    }
+}
+
+void timer_tick()
+{
+    u64 now = timer_uptime();
+
+    while (1)
+    {
+        spinlock_acquire_irqsave(&timer_lock);
+
+        if (timers_count == 0 || timers[0]->deadline > now)
+        {
+            spinlock_release_irqrestore(&timer_lock);
+            return;
+        }
+
+        timer_t *timer = timers[0];
+        timers_remove(0);
+
+        spinlock_release_irqrestore(&timer_lock);
+
+        timer->callback(timer->data);
+    }
+}
+
+void timer_reschedule(bool preempt)
+{
+    spinlock_acquire_irqsave(&timer_lock);
+
+    uint delay = TIMER_MAX_DELAY;
+
+    if (!timer_dynamic)
+    {
+        delay = TIMER_TICK_US;
+    }
+    else
+    {
+        if (preempt && timer_quantum < delay)
+        {
+            delay = timer_quantum;
+        }
+
+        if (timers_count > 0)
+        {
+            u64 now = timer_uptime();
+            u64 deadline = timers[0]->deadline;
+
+            if (deadline <= now)
+            {
+                delay = TIMER_MIN_DELAY;
+            }
+            else if (deadline - now < delay)
+            {
+                delay = (uint)(deadline - now);
+            }
+        }
+
+        if (delay < TIMER_MIN_DELAY)
+        {
+            delay = TIMER_MIN_DELAY;
+        }
+    }
+
+    timer_preempt = preempt;
+    timer_program(delay);
+
+    spinlock_release_irqrestore(&timer_lock);
+}
+
+void timer_request_preempt()
+{
+    spinlock_acquire_irqsave(&timer_lock);
+
+    if (!timer_preempt)
+    {
+        timer_reschedule(true);
+    }
+
+    spinlock_release_irqrestore(&timer_lock);
+}
+
+void timer_set_quantum(uint usec)
+{
+    timer_quantum = usec < TIMER_MIN_DELAY ? TIMER_MIN_DELAY : usec;
+    sk_log(LOG_DEBUG, "Timer quantum set to %dus.", timer_quantum);
+}
+
+void timer_set_dynamic(bool dynamic)
+{
+    timer_dynamic = dynamic;
+    sk_log(LOG_DEBUG, "Timer dynamic mode %s.", dynamic ? "enabled" : "disabled");
+}
@@ -6,6 +6,35 @@
 #define MSGPAYLOAD_SIZE 1024
 #define MSGLABEL_SIZE 128
 
+/* --- Threads priority ----------------------------------------------------- */
+
+#define THREAD_PRIORITY_COUNT 32
+
+#define THREAD_PRIORITY_IDLE 0
+#define THREAD_PRIORITY_LOW 8
+#define THREAD_PRIORITY_NORMAL 16
+#define THREAD_PRIORITY_HIGH 24
+#define THREAD_PRIORITY_MAX (THREAD_PRIORITY_COUNT - 1)
+
+/* --- Threads sheduling policy --------------------------------------------- */
+
+// Real-time threads always run before normal ones, whatever their priority.
+// FIFO threads run until they block, yield or a more important real-time
+// thread is ready; round-robin ones also share the cpu with the real-time
+// threads of the same priority.
+
+#define THREAD_POLICY_NORMAL 0
+#define THREAD_POLICY_FIFO 1
+#define THREAD_POLICY_RR 2
+
+/* --- Threads creation flags ----------------------------------------------- */
+
+// The thread runs on the processor of its creator and is never moved to
+// another one, used to measure things on a single processor.
+#define THREAD_PINNED (1 << 1)
+
+/* --- Messages ------------------------------------------------------------- */
+
 typedef struct 
 {
     uint id;
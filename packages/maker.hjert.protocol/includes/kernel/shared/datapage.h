@@ -0,0 +1,59 @@
+#pragma once
+
+#include <skift/generic.h>
+
+/*
+ * Read-only pages mapped at the top of every user address space, through
+ * which the kernel publish the data the runtime needs most often, so it can
+ * be read without a syscall.
+ *
+ * The kernel data page is the same for every process, the process data page
+ * belong to a single process.
+ */
+
+#define KERNEL_DATAPAGE_ADDRESS 0xFFFFF000
+#define PROCESS_DATAPAGE_ADDRESS 0xFFFFE000
+
+#define PROCESS_DATAPAGE_THREADS 128
+
+typedef struct
+{
+    uint second;
+    uint minute;
+    uint hour;
+    uint day;
+    uint month;
+    uint year;
+} datapage_time_t;
+
+typedef struct
+{
+    // Odd while the kernel is updating the page, readers must retry until they
+    // see the same even value before and after reading it.
+    volatile uint sequence;
+
+    uint ticks; // Ticks of the kernel timer since boot.
+    u64 uptime; // Microseconds since boot when the page was updated.
+
+    // Used to tell how much time passed since the update, tsc_per_us is 0 when
+    // the time stamp counter can't be used.
+    u32 tsc;
+    uint tsc_per_us;
+
+    datapage_time_t time; // Wall clock time, updated every second.
+} kernel_datapage_t;
+
+typedef struct
+{
+    int process;
+
+    // Threads are found from their stack pointer, a slot is free when its
+    // stack is 0. Threads that didn't get a slot must ask the kernel.
+    uint stack_size;
+
+    struct
+    {
+        uint stack;
+        int thread;
+    } threads[PROCESS_DATAPAGE_THREADS];
+} process_datapage_t;
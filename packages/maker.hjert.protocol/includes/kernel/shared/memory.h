@@ -0,0 +1,7 @@
+#pragma once
+
+// Flags of the SYS_PROCESS_ALLOC syscall.
+
+// Back the memory with 4Mio pages when possible. It is rounded up to a whole
+// large page and made resident right away.
+#define PROCESS_ALLOC_LARGE (1 << 0)
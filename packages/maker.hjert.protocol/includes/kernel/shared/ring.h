@@ -0,0 +1,54 @@
+#pragma once
+
+#include <skift/generic.h>
+
+/*
+ * Submission and completion ring shared by a process and the kernel.
+ *
+ * The process queues operations in the submission ring, then hand them all to
+ * the kernel with a single SYS_RING_ENTER. The kernel posts the result of each
+ * operation in the completion ring, where the process reaps them without
+ * further syscalls.
+ *
+ * Heads and tails only move forward, the process writes `submission_tail` and
+ * `completion_head`, the kernel the two others.
+ */
+
+#define RING_SUBMISSIONS 64
+#define RING_COMPLETIONS (RING_SUBMISSIONS * 2)
+
+typedef enum
+{
+    RING_OP_NOP,
+    RING_OP_PRINT,     // (const char *msg)
+    RING_OP_SEND,      // (int to, const char *name, void *payload, uint size, uint flags)
+    RING_OP_BROADCAST, // (const char *channel, const char *name, void *payload, uint size, uint flags)
+    RING_OP_BLIT,      // (uint *buffer, uint x, uint y, uint w, uint h)
+    RING_OP_FILE_READ, // (const char *path, uint offset, void *buffer, uint size)
+
+    RING_OP_COUNT
+} ring_op_t;
+
+typedef struct
+{
+    ring_op_t op;
+    int params[5];
+    uint data; // Given back with the completion.
+} ring_submission_t;
+
+typedef struct
+{
+    uint data;
+    int result;
+} ring_completion_t;
+
+typedef struct
+{
+    volatile uint submission_head;
+    volatile uint submission_tail;
+    volatile uint completion_head;
+    volatile uint completion_tail;
+
+    ring_submission_t submissions[RING_SUBMISSIONS];
+    ring_completion_t completions[RING_COMPLETIONS];
+} ring_t;
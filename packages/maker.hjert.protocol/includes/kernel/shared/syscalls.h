@@ -10,6 +10,7 @@ typedef enum
     SYS_PROCESS_SELF,
 
     SYS_PROCESS_EXEC,
+    SYS_PROCESS_CLONE,
     SYS_PROCESS_EXIT,
     SYS_PROCESS_CANCEL,
 
@@ -26,11 +27,20 @@ typedef enum
     SYS_THREAD_CANCEL,
 
     SYS_THREAD_SLEEP,
+    SYS_THREAD_USLEEP,
     SYS_THREAD_WAKEUP,
 
     SYS_THREAD_WAIT,
     SYS_THREAD_WAITPROC,
 
+    SYS_THREAD_SETPRIORITY,
+    SYS_THREAD_GETPRIORITY,
+    SYS_THREAD_SETPOLICY,
+    SYS_THREAD_GETPOLICY,
+
+    SYS_THREAD_FUTEX_WAIT,
+    SYS_THREAD_FUTEX_WAKE,
+
     // Messaging
     SYS_MSG_SEND,
     SYS_MSG_BROADCAST,
@@ -53,6 +63,10 @@ typedef enum
     SYS_IO_GRAPHIC_BLIT_REGION,
     SYS_IO_GRAPHIC_SIZE,
 
+    // Submission ring
+    SYS_RING_SETUP,
+    SYS_RING_ENTER,
+
     /* --- Filesystem ----------------------------------------------------------- */
 
     // Files
@@ -91,11 +105,36 @@ typedef enum
     SYSCALL_COUNT
 } syscall_t;
 
-static inline int __syscall(syscall_t syscall, int p1, int p2, int p3, int p4, int p5)
+// Set by the runtime when the processor supports SYSENTER.
+extern int __syscall_sysenter;
+
+static inline int __syscall_int80(syscall_t syscall, int p1, int p2, int p3, int p4, int p5)
 {
     int __ret;
     __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x80; pop %%ebx"
                          : "=a"(__ret)
                          : "0"(syscall), "r"((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4)), "D"((int)(p5)));
     return __ret;
+}
+
+// The kernel switches back to the stack in ebp and returns to the address on
+// top of it, ecx and edx are not preserved.
+static inline int __syscall_fast(syscall_t syscall, int p1, int p2, int p3, int p4, int p5)
+{
+    int __ret;
+    __asm__ __volatile__("push %%ebp; push %%ebx; movl %3,%%ebx; push $1f; movl %%esp,%%ebp; sysenter; 1: pop %%ebx; pop %%ebp"
+                         : "=a"(__ret), "+c"(p2), "+d"(p3)
+                         : "r"((int)(p1)), "0"(syscall), "S"((int)(p4)), "D"((int)(p5))
+                         : "memory", "cc");
+    return __ret;
+}
+
+static inline int __syscall(syscall_t syscall, int p1, int p2, int p3, int p4, int p5)
+{
+    if (__syscall_sysenter)
+    {
+        return __syscall_fast(syscall, p1, p2, p3, p4, p5);
+    }
+
+    return __syscall_int80(syscall, p1, p2, p3, p4, p5);
 }
\ No newline at end of file
@@ -23,4 +23,11 @@ int __plug_memalloc_lock();
 int __plug_memalloc_unlock();
 
 void* __plug_memalloc_alloc(uint size);
-int __plug_memalloc_free(void* memory, uint size);
\ No newline at end of file
+int __plug_memalloc_free(void* memory, uint size);
+
+// Atomic sections plugs
+int __plug_processor_id(); // Identify the processor executing the caller.
+
+// Mutex plugs
+int __plug_futex_wait(int *addr, int expected); // Sleep while *addr == expected.
+int __plug_futex_wake(int *addr, int count);    // Wake up to count threads sleeping on addr.
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+
+/*
+ * Locks that only enter the kernel when they are contended, the waiting
+ * threads sleep instead of spinning until the next tick.
+ */
+
+typedef struct
+{
+    int state; // 0: unlocked, 1: locked, 2: locked with waiters.
+} mutex_t;
+
+typedef struct
+{
+    int sequence; // Bumped on each signal, the waiters sleep on it.
+    int waiters;
+} condition_t;
+
+typedef struct
+{
+    mutex_t lock;
+    condition_t changed;
+
+    int readers;
+    int writer;
+    int writers_waiting;
+} rwlock_t;
+
+void __sk_mutex_init(mutex_t *mutex);
+void __sk_mutex_lock(mutex_t *mutex);
+int __sk_mutex_trylock(mutex_t *mutex);
+void __sk_mutex_unlock(mutex_t *mutex);
+
+void __sk_condition_init(condition_t *condition);
+void __sk_condition_wait(condition_t *condition, mutex_t *mutex);
+void __sk_condition_signal(condition_t *condition);
+void __sk_condition_broadcast(condition_t *condition);
+
+void __sk_rwlock_init(rwlock_t *rwlock);
+void __sk_rwlock_read_lock(rwlock_t *rwlock);
+void __sk_rwlock_read_unlock(rwlock_t *rwlock);
+void __sk_rwlock_write_lock(rwlock_t *rwlock);
+void __sk_rwlock_write_unlock(rwlock_t *rwlock);
+
+#define sk_mutex_init(mutex) __sk_mutex_init(&mutex)
+#define sk_mutex_lock(mutex) __sk_mutex_lock(&mutex)
+#define sk_mutex_trylock(mutex) __sk_mutex_trylock(&mutex)
+#define sk_mutex_unlock(mutex) __sk_mutex_unlock(&mutex)
+
+#define sk_condition_init(condition) __sk_condition_init(&condition)
+#define sk_condition_wait(condition, mutex) __sk_condition_wait(&condition, &mutex)
+#define sk_condition_signal(condition) __sk_condition_signal(&condition)
+#define sk_condition_broadcast(condition) __sk_condition_broadcast(&condition)
+
+#define sk_rwlock_init(rwlock) __sk_rwlock_init(&rwlock)
+#define sk_rwlock_read_lock(rwlock) __sk_rwlock_read_lock(&rwlock)
+#define sk_rwlock_read_unlock(rwlock) __sk_rwlock_read_unlock(&rwlock)
+#define sk_rwlock_write_lock(rwlock) __sk_rwlock_write_lock(&rwlock)
+#define sk_rwlock_write_unlock(rwlock) __sk_rwlock_write_unlock(&rwlock)
+
+#define MUTEX(mutex, code)          \
+    do                              \
+    {                               \
+        __sk_mutex_lock(&mutex);    \
+        code;                       \
+        __sk_mutex_unlock(&mutex);  \
+    } while (0);
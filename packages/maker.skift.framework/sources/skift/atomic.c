@@ -1,9 +1,32 @@
 #include <skift/types.h>
+#include <skift/lock.h>
 #include <skift/atomic.h>
+#include <skift/__plugs.h>
+
+/*
+ * Atomic sections disable interrupts on the current processor and hold a
+ * single lock shared by all the processors. The lock is recursive for the
+ * processor owning it, and the interrupt flag is restored as it was when the
+ * outermost section was entered.
+ */
 
 bool enabled = 0;
 uint depth = 0;
 
+lock_t atomic_lock = {0};
+int owner = -1;
+bool interrupts = false;
+
+static inline bool interrupts_enabled()
+{
+    uint flags;
+    asm volatile("pushf\n"
+                 "pop %0"
+                 : "=r"(flags));
+
+    return flags & 0x200;
+}
+
 void sk_atomic_enable()
 {
     enabled = true;
@@ -18,7 +41,18 @@ void sk_atomic_begin()
 {
     if (enabled)
     {
+        bool was_enabled = interrupts_enabled();
         asm volatile("cli");
+
+        int processor = __plug_processor_id();
+
+        if (owner != processor)
+        {
+            __sk_lock_acquire(&atomic_lock);
+            owner = processor;
+            interrupts = was_enabled;
+        }
+
         depth++;
     }
 }
@@ -28,7 +62,16 @@ void sk_atomic_end()
     if (enabled)
     {
         depth--;
+
         if (depth == 0)
-            asm volatile("sti");
+        {
+            bool restore = interrupts;
+
+            owner = -1;
+            __sk_lock_release(&atomic_lock);
+
+            if (restore)
+                asm volatile("sti");
+        }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,158 @@
+#include <skift/mutex.h>
+#include <skift/__plugs.h>
+
+/* --- Mutex ---------------------------------------------------------------- */
+
+void __sk_mutex_init(mutex_t *mutex)
+{
+    mutex->state = 0;
+}
+
+void __sk_mutex_lock(mutex_t *mutex)
+{
+    int state = __sync_val_compare_and_swap(&mutex->state, 0, 1);
+
+    if (state != 0)
+    {
+        // Tell the owner someone is waiting, then sleep until it's released.
+        if (state != 2)
+        {
+            state = __sync_lock_test_and_set(&mutex->state, 2);
+        }
+
+        while (state != 0)
+        {
+            __plug_futex_wait(&mutex->state, 2);
+            state = __sync_lock_test_and_set(&mutex->state, 2);
+        }
+    }
+}
+
+int __sk_mutex_trylock(mutex_t *mutex)
+{
+    return __sync_bool_compare_and_swap(&mutex->state, 0, 1);
+}
+
+void __sk_mutex_unlock(mutex_t *mutex)
+{
+    if (__sync_fetch_and_sub(&mutex->state, 1) != 1)
+    {
+        mutex->state = 0;
+        __plug_futex_wake(&mutex->state, 1);
+    }
+}
+
+/* --- Condition ------------------------------------------------------------ */
+
+void __sk_condition_init(condition_t *condition)
+{
+    condition->sequence = 0;
+    condition->waiters = 0;
+}
+
+void __sk_condition_wait(condition_t *condition, mutex_t *mutex)
+{
+    int sequence = condition->sequence;
+
+    __sync_fetch_and_add(&condition->waiters, 1);
+    __sk_mutex_unlock(mutex);
+
+    __plug_futex_wait(&condition->sequence, sequence);
+
+    __sync_fetch_and_sub(&condition->waiters, 1);
+
+    // Other threads may have been woken up with us, take the mutex as
+    // contended so they get woken up when we release it.
+    while (__sync_lock_test_and_set(&mutex->state, 2) != 0)
+    {
+        __plug_futex_wait(&mutex->state, 2);
+    }
+}
+
+void __sk_condition_signal(condition_t *condition)
+{
+    __sync_fetch_and_add(&condition->sequence, 1);
+
+    if (condition->waiters > 0)
+    {
+        __plug_futex_wake(&condition->sequence, 1);
+    }
+}
+
+void __sk_condition_broadcast(condition_t *condition)
+{
+    __sync_fetch_and_add(&condition->sequence, 1);
+
+    if (condition->waiters > 0)
+    {
+        __plug_futex_wake(&condition->sequence, condition->waiters);
+    }
+}
+
+/* --- Reader-writer lock --------------------------------------------------- */
+
+void __sk_rwlock_init(rwlock_t *rwlock)
+{
+    __sk_mutex_init(&rwlock->lock);
+    __sk_condition_init(&rwlock->changed);
+
+    rwlock->readers = 0;
+    rwlock->writer = 0;
+    rwlock->writers_waiting = 0;
+}
+
+void __sk_rwlock_read_lock(rwlock_t *rwlock)
+{
+    __sk_mutex_lock(&rwlock->lock);
+
+    // Waiting writers go first, so they don't starve.
+    while (rwlock->writer || rwlock->writers_waiting > 0)
+    {
+        __sk_condition_wait(&rwlock->changed, &rwlock->lock);
+    }
+
+    rwlock->readers++;
+
+    __sk_mutex_unlock(&rwlock->lock);
+}
+
+void __sk_rwlock_read_unlock(rwlock_t *rwlock)
+{
+    __sk_mutex_lock(&rwlock->lock);
+
+    rwlock->readers--;
+
+    if (rwlock->readers == 0)
+    {
+        __sk_condition_broadcast(&rwlock->changed);
+    }
+
+    __sk_mutex_unlock(&rwlock->lock);
+}
+
+void __sk_rwlock_write_lock(rwlock_t *rwlock)
+{
+    __sk_mutex_lock(&rwlock->lock);
+
+    rwlock->writers_waiting++;
+
+    while (rwlock->writer || rwlock->readers > 0)
+    {
+        __sk_condition_wait(&rwlock->changed, &rwlock->lock);
+    }
+
+    rwlock->writers_waiting--;
+    rwlock->writer = 1;
+
+    __sk_mutex_unlock(&rwlock->lock);
+}
+
+void __sk_rwlock_write_unlock(rwlock_t *rwlock)
+{
+    __sk_mutex_lock(&rwlock->lock);
+
+    rwlock->writer = 0;
+    __sk_condition_broadcast(&rwlock->changed);
+
+    __sk_mutex_unlock(&rwlock->lock);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <skift/generic.h>
+#include "kernel/shared/datapage.h"
+
+// Read from the kernel data page, without any syscall.
+
+uint sk_clock_ticks();                     // Ticks of the kernel timer since boot.
+u64 sk_clock_uptime();                     // Microseconds since boot.
+void sk_clock_time(datapage_time_t *time); // Wall clock time.
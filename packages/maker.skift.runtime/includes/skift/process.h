@@ -3,11 +3,18 @@
 #include <skift/generic.h>
 #include <skift/syscalls.h>
 
+#include "kernel/shared/memory.h"
+
 DECL_SYSCALL0(sk_process_self);
 DECL_SYSCALL2(sk_process_exec, const char * path, const char ** argv);
+
+// Start a copy of the calling process with a single thread running `entry`,
+// their memory is shared copy-on-write. Locks held by other threads while
+// cloning stay held in the copy.
+DECL_SYSCALL1(sk_process_clone, int entry);
 DECL_SYSCALL1(sk_process_exit, int code);
 DECL_SYSCALL1(sk_process_cancel, int pid);
 DECL_SYSCALL2(sk_process_map, unsigned int addr, unsigned int count);
 DECL_SYSCALL2(sk_process_unmap, unsigned int addr, unsigned int count);
-DECL_SYSCALL1(sk_process_alloc, unsigned int count);
+DECL_SYSCALL2(sk_process_alloc, unsigned int count, int flags); // See PROCESS_ALLOC_*.
 DECL_SYSCALL2(sk_process_free, unsigned int addr, unsigned int count);
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <skift/generic.h>
+#include <skift/syscalls.h>
+#include "kernel/shared/ring.h"
+
+DECL_SYSCALL0(sk_ring_setup); // Return the address of the ring of the process.
+DECL_SYSCALL0(sk_ring_enter); // Run the queued operations, return how many were run.
+
+ring_t *sk_ring(); // The ring of the process, set up on the first call.
+
+// Queue an operation, return false if the submission ring is full.
+bool sk_ring_push(ring_t *ring, ring_op_t op, int p1, int p2, int p3, int p4, int p5, uint data);
+
+bool sk_ring_print(ring_t *ring, const char *msg, uint data);
+bool sk_ring_send(ring_t *ring, int to, const char *name, void *payload, uint size, uint flags, uint data);
+bool sk_ring_broadcast(ring_t *ring, const char *channel, const char *name, void *payload, uint size, uint flags, uint data);
+bool sk_ring_blit(ring_t *ring, uint *buffer, uint x, uint y, uint w, uint h, uint data);
+bool sk_ring_file_read(ring_t *ring, const char *path, uint offset, void *buffer, uint size, uint data);
+
+// Take the oldest completion, return false if there is none.
+bool sk_ring_reap(ring_t *ring, ring_completion_t *completion);
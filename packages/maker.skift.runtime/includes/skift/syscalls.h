@@ -3,6 +3,8 @@
 #include "kernel/protocol.h"
 #include "kernel/shared/syscalls.h"
 
+void __syscall_setup(void); // Use SYSENTER for the syscalls when the processor supports it.
+
 #define DECL_SYSCALL0(fn) int fn()
 #define DECL_SYSCALL1(fn, p1) int fn(p1)
 #define DECL_SYSCALL2(fn, p1, p2) int fn(p1, p2)
@@ -8,6 +8,13 @@ DECL_SYSCALL3(sk_thread_create, int entry, void *arg, int flags);
 DECL_SYSCALL1(sk_thread_exit, void *exitval);
 DECL_SYSCALL1(sk_thread_cancel, int thread);
 DECL_SYSCALL1(sk_thread_sleep, int time);
+DECL_SYSCALL1(sk_thread_usleep, unsigned int usec);
 DECL_SYSCALL1(sk_thread_wakeup, int thread);
 DECL_SYSCALL1(sk_thread_wait, int thread);
-DECL_SYSCALL1(sk_thread_waitproc, int process);
\ No newline at end of file
+DECL_SYSCALL1(sk_thread_waitproc, int process);
+DECL_SYSCALL2(sk_thread_setpriority, int thread, int priority);
+DECL_SYSCALL1(sk_thread_getpriority, int thread);
+DECL_SYSCALL3(sk_thread_setpolicy, int thread, int policy, int priority);
+DECL_SYSCALL1(sk_thread_getpolicy, int thread);
+DECL_SYSCALL2(sk_thread_futex_wait, int *addr, int expected);
+DECL_SYSCALL2(sk_thread_futex_wake, int *addr, int count);
\ No newline at end of file
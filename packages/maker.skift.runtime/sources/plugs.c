@@ -6,19 +6,22 @@
 
 #include <string.h>
 #include <skift/io.h>
-#include <skift/lock.h>
+#include <skift/mutex.h>
 #include <skift/process.h>
+#include <skift/thread.h>
 #include <skift/logger.h>
 #include <skift/formatter.h>
 #include <skift/__plugs.h>
 
-lock_t memlock;
-lock_t loglock;
+mutex_t memlock;
+mutex_t loglock;
 
 void __plug_init(void)
 {
-    sk_lock_init(memlock);
-    sk_lock_init(loglock);
+    __syscall_setup();
+
+    sk_mutex_init(memlock);
+    sk_mutex_init(loglock);
     sk_formatter_init();
 }
 
@@ -55,35 +58,58 @@ void __plug_assert_failed(const char *expr, const char *file, const char *functi
 
 int __plug_logger_lock()
 {
-    sk_lock_acquire(loglock);
+    sk_mutex_lock(loglock);
     return 0;
 }
 
 int __plug_logger_unlock()
 {
-    sk_lock_release(loglock);
+    sk_mutex_unlock(loglock);
     return 0;
 }
 
 int __plug_memalloc_lock()
 {
-    sk_lock_acquire(memlock);
+    sk_mutex_lock(memlock);
     return 0;
 }
 
 int __plug_memalloc_unlock()
 {
-    sk_lock_release(memlock);
+    sk_mutex_unlock(memlock);
     return 0;
 }
 
+// Large pages cover 1024 pages, only use them when rounding up wastes less
+// than a quarter of the allocation.
+#define LARGE_ALLOC_PAGES 1024
+
 void* __plug_memalloc_alloc(uint size)
 {
-    uint addr = sk_process_alloc(size);
+    uint rounded = (size + LARGE_ALLOC_PAGES - 1) / LARGE_ALLOC_PAGES * LARGE_ALLOC_PAGES;
+    int flags = (size >= LARGE_ALLOC_PAGES && (rounded - size) * 4 <= size) ? PROCESS_ALLOC_LARGE : 0;
+
+    uint addr = sk_process_alloc(size, flags);
     return (void*)addr;
 }
 
 int __plug_memalloc_free(void* memory, uint size)
 {
     return sk_process_free((unsigned int)memory, size);
-}
\ No newline at end of file
+}
+
+int __plug_processor_id()
+{
+    // Atomic sections are not used in userspace.
+    return 0;
+}
+
+int __plug_futex_wait(int *addr, int expected)
+{
+    return sk_thread_futex_wait(addr, expected);
+}
+
+int __plug_futex_wake(int *addr, int count)
+{
+    return sk_thread_futex_wake(addr, count);
+}
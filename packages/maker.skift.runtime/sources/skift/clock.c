@@ -0,0 +1,75 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/clock.h>
+
+#define KERNEL_DATAPAGE ((kernel_datapage_t *)KERNEL_DATAPAGE_ADDRESS)
+
+static inline u32 rdtsc32(void)
+{
+    u32 low, high;
+    asm volatile("rdtsc"
+                 : "=a"(low), "=d"(high));
+    return low;
+}
+
+// Wait for the kernel to be done with the page.
+static inline uint datapage_read_begin(kernel_datapage_t *page)
+{
+    uint sequence;
+
+    while ((sequence = page->sequence) & 1)
+    {
+        asm volatile("pause");
+    }
+
+    __sync_synchronize();
+    return sequence;
+}
+
+static inline bool datapage_read_retry(kernel_datapage_t *page, uint sequence)
+{
+    __sync_synchronize();
+    return page->sequence != sequence;
+}
+
+uint sk_clock_ticks()
+{
+    return KERNEL_DATAPAGE->ticks;
+}
+
+u64 sk_clock_uptime()
+{
+    kernel_datapage_t *page = KERNEL_DATAPAGE;
+
+    uint sequence;
+    u64 uptime;
+
+    do
+    {
+        sequence = datapage_read_begin(page);
+
+        uptime = page->uptime;
+
+        if (page->tsc_per_us != 0)
+        {
+            uptime += (rdtsc32() - page->tsc) / page->tsc_per_us;
+        }
+    } while (datapage_read_retry(page, sequence));
+
+    return uptime;
+}
+
+void sk_clock_time(datapage_time_t *time)
+{
+    kernel_datapage_t *page = KERNEL_DATAPAGE;
+
+    uint sequence;
+
+    do
+    {
+        sequence = datapage_read_begin(page);
+        *time = page->time;
+    } while (datapage_read_retry(page, sequence));
+}
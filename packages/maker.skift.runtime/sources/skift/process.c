@@ -3,9 +3,15 @@
 /* See: LICENSE.md                                                            */
 
 #include <skift/process.h>
+#include "kernel/shared/datapage.h"
+
+int sk_process_self()
+{
+    return ((process_datapage_t *)PROCESS_DATAPAGE_ADDRESS)->process;
+}
 
-DEFN_SYSCALL0(sk_process_self, SYS_PROCESS_SELF);
 DEFN_SYSCALL2(sk_process_exec, SYS_PROCESS_EXEC, const char *, const char **);
+DEFN_SYSCALL1(sk_process_clone, SYS_PROCESS_CLONE, int);
 
 DEFN_SYSCALL1(sk_process_exit, SYS_PROCESS_EXIT, int);
 DEFN_SYSCALL1(sk_process_cancel, SYS_PROCESS_CANCEL, int);
@@ -13,5 +19,5 @@ DEFN_SYSCALL1(sk_process_cancel, SYS_PROCESS_CANCEL, int);
 DEFN_SYSCALL2(sk_process_map, SYS_PROCESS_MAP, unsigned int, unsigned int);
 DEFN_SYSCALL2(sk_process_unmap, SYS_PROCESS_UNMAP, unsigned int, unsigned int);
 
-DEFN_SYSCALL1(sk_process_alloc, SYS_PROCESS_ALLOC, unsigned int);
+DEFN_SYSCALL2(sk_process_alloc, SYS_PROCESS_ALLOC, unsigned int, int);
 DEFN_SYSCALL2(sk_process_free,  SYS_PROCESS_FREE, unsigned int, unsigned int);
\ No newline at end of file
@@ -0,0 +1,86 @@
+/* Copyright © 2018-2019 MAKER.                                               */
+/* This code is licensed under the MIT License.                               */
+/* See: LICENSE.md                                                            */
+
+#include <skift/ring.h>
+
+DEFN_SYSCALL0(sk_ring_setup, SYS_RING_SETUP);
+DEFN_SYSCALL0(sk_ring_enter, SYS_RING_ENTER);
+
+static ring_t *process_ring = NULL;
+
+ring_t *sk_ring()
+{
+    if (process_ring == NULL)
+    {
+        process_ring = (ring_t *)sk_ring_setup();
+    }
+
+    return process_ring;
+}
+
+bool sk_ring_push(ring_t *ring, ring_op_t op, int p1, int p2, int p3, int p4, int p5, uint data)
+{
+    if (ring->submission_tail - ring->submission_head >= RING_SUBMISSIONS)
+    {
+        return false;
+    }
+
+    ring_submission_t *submission = &ring->submissions[ring->submission_tail % RING_SUBMISSIONS];
+
+    submission->op = op;
+    submission->params[0] = p1;
+    submission->params[1] = p2;
+    submission->params[2] = p3;
+    submission->params[3] = p4;
+    submission->params[4] = p5;
+    submission->data = data;
+
+    // The submission must be filled before the kernel can see it.
+    __sync_synchronize();
+    ring->submission_tail++;
+
+    return true;
+}
+
+bool sk_ring_print(ring_t *ring, const char *msg, uint data)
+{
+    return sk_ring_push(ring, RING_OP_PRINT, (int)msg, 0, 0, 0, 0, data);
+}
+
+bool sk_ring_send(ring_t *ring, int to, const char *name, void *payload, uint size, uint flags, uint data)
+{
+    return sk_ring_push(ring, RING_OP_SEND, to, (int)name, (int)payload, size, flags, data);
+}
+
+bool sk_ring_broadcast(ring_t *ring, const char *channel, const char *name, void *payload, uint size, uint flags, uint data)
+{
+    return sk_ring_push(ring, RING_OP_BROADCAST, (int)channel, (int)name, (int)payload, size, flags, data);
+}
+
+bool sk_ring_blit(ring_t *ring, uint *buffer, uint x, uint y, uint w, uint h, uint data)
+{
+    return sk_ring_push(ring, RING_OP_BLIT, (int)buffer, x, y, w, h, data);
+}
+
+bool sk_ring_file_read(ring_t *ring, const char *path, uint offset, void *buffer, uint size, uint data)
+{
+    return sk_ring_push(ring, RING_OP_FILE_READ, (int)path, offset, (int)buffer, size, 0, data);
+}
+
+bool sk_ring_reap(ring_t *ring, ring_completion_t *completion)
+{
+    if (ring->completion_head == ring->completion_tail)
+    {
+        return false;
+    }
+
+    __sync_synchronize();
+    *completion = ring->completions[ring->completion_head % RING_COMPLETIONS];
+
+    // Let the kernel reuse the slot only once we are done reading it.
+    __sync_synchronize();
+    ring->completion_head++;
+
+    return true;
+}
@@ -4,3 +4,15 @@
 
 #include <skift/syscalls.h>
 
+#define CPUID_FEAT_EDX_SEP (1 << 11)
+
+int __syscall_sysenter = 0;
+
+void __syscall_setup(void)
+{
+    uint eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid"
+                 : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+    __syscall_sysenter = (edx & CPUID_FEAT_EDX_SEP) != 0;
+}
@@ -3,15 +3,42 @@
 /* See: LICENSE.md                                                            */
 
 #include <skift/thread.h>
+#include "kernel/shared/datapage.h"
+
+int sk_thread_self()
+{
+    process_datapage_t *page = (process_datapage_t *)PROCESS_DATAPAGE_ADDRESS;
+    uint esp = (uint)__builtin_frame_address(0);
+
+    for (int i = 0; i < PROCESS_DATAPAGE_THREADS; i++)
+    {
+        uint stack = page->threads[i].stack;
+
+        if (stack != 0 && esp - stack < page->stack_size)
+        {
+            return page->threads[i].thread;
+        }
+    }
+
+    return __syscall(SYS_THREAD_SELF, 0, 0, 0, 0, 0);
+}
 
-DEFN_SYSCALL0(sk_thread_self, SYS_THREAD_SELF);
 DEFN_SYSCALL3(sk_thread_create, SYS_THREAD_CREATE, int, void *, int);
 
 DEFN_SYSCALL1(sk_thread_exit, SYS_THREAD_EXIT, void *);
 DEFN_SYSCALL1(sk_thread_cancel, SYS_THREAD_CANCEL, int);
 
 DEFN_SYSCALL1(sk_thread_sleep, SYS_THREAD_SLEEP, int);
+DEFN_SYSCALL1(sk_thread_usleep, SYS_THREAD_USLEEP, unsigned int);
 DEFN_SYSCALL1(sk_thread_wakeup, SYS_THREAD_WAKEUP, int);
 
 DEFN_SYSCALL1(sk_thread_wait, SYS_THREAD_WAIT, int);
-DEFN_SYSCALL1(sk_thread_waitproc, SYS_THREAD_WAITPROC, int);
\ No newline at end of file
+DEFN_SYSCALL1(sk_thread_waitproc, SYS_THREAD_WAITPROC, int);
+
+DEFN_SYSCALL2(sk_thread_setpriority, SYS_THREAD_SETPRIORITY, int, int);
+DEFN_SYSCALL1(sk_thread_getpriority, SYS_THREAD_GETPRIORITY, int);
+DEFN_SYSCALL3(sk_thread_setpolicy, SYS_THREAD_SETPOLICY, int, int, int);
+DEFN_SYSCALL1(sk_thread_getpolicy, SYS_THREAD_GETPOLICY, int);
+
+DEFN_SYSCALL2(sk_thread_futex_wait, SYS_THREAD_FUTEX_WAIT, int *, int);
+DEFN_SYSCALL2(sk_thread_futex_wake, SYS_THREAD_FUTEX_WAKE, int *, int);
\ No newline at end of file